@@ -2,6 +2,11 @@
 
 #include "complex"
 #include "math.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 
 using complex_t  = std::complex<double>;
@@ -9,7 +14,7 @@ using complex_t  = std::complex<double>;
 #define _USE_MATH_DEFINES
 const double PI = M_PI;
 const complex_t I = complex_t(0, 1);
-const double EPS = 1e-7;
+constexpr double EPS = 1e-7;
 
 complex_t CalcKernel(double power, double base) {
     double phi = 2 * PI * power / base;
@@ -20,9 +25,28 @@ complex_t CalcKernelNormalized(double phi) {
     return {cos(phi), sin(phi)};
 }
 
+// Magnitude below which values computed from samples of the real type are zero. Rounding errors
+// of float samples are far above EPS, the threshold of float keeps a margin over its epsilon.
+template <class Real>
+struct RealTraits;
+
+template <>
+struct RealTraits<double> {
+    static constexpr double kEps = EPS;
+};
+
+template <>
+struct RealTraits<float> {
+    static constexpr double kEps = 1e-5;
+};
+
+bool NonZero(complex_t value, double eps) {
+    // two times faster than abs(value) > eps
+    return value.real() > eps || value.real() < -eps || value.imag() > eps || value.imag() < -eps;
+}
+
 bool NonZero(complex_t value) {
-    // two times faster than abs(value) > EPS
-    return value.real() > EPS || value.real() < -EPS || value.imag() > EPS || value.imag() < -EPS;
+    return NonZero(value, EPS);
 }
 
 int CalcLog(int64_t v) {
@@ -32,4 +56,75 @@ int CalcLog(int64_t v) {
         ++res;
     }
     return res;
-}
\ No newline at end of file
+}
+
+// Table of exp(2 * pi * i * k / n) for a power of two n, indexed by k modulo n.
+// Wide tables are split into two levels of O(sqrt(n)) entries each.
+class RootsOfUnity {
+public:
+    explicit RootsOfUnity(int64_t n) : mask_(n - 1) {
+        int log = CalcLog(n);
+        low_bits_ = log <= kMaxDirectLog ? log : (log + 1) / 2;
+        low_mask_ = (1ll << low_bits_) - 1;
+        low_.resize(1ll << low_bits_);
+        for (int64_t k = 0; k < static_cast<int64_t>(low_.size()); ++k) {
+            low_[k] = CalcKernel(static_cast<double>(k), static_cast<double>(n));
+        }
+        high_.resize(1ll << (log - low_bits_));
+        for (int64_t k = 0; k < static_cast<int64_t>(high_.size()); ++k) {
+            high_[k] = CalcKernel(static_cast<double>(k << low_bits_), static_cast<double>(n));
+        }
+    }
+
+    complex_t operator[](int64_t k) const {
+        k &= mask_;
+        if (k <= low_mask_) {
+            return low_[k];
+        }
+        const complex_t& a = high_[k >> low_bits_];
+        const complex_t& b = low_[k & low_mask_];
+        return {a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real()};
+    }
+
+    int64_t Size() const {
+        return mask_ + 1;
+    }
+
+    // exp(2 * pi * i * k / n) = High()[k >> LowBits()] * Low()[k & (2^LowBits() - 1)]
+    const complex_t* Low() const {
+        return low_.data();
+    }
+
+    const complex_t* High() const {
+        return high_.data();
+    }
+
+    int LowBits() const {
+        return low_bits_;
+    }
+
+    bool IsDirect() const {
+        return high_.size() == 1;
+    }
+
+private:
+    static constexpr int kMaxDirectLog = 12;
+
+    int64_t mask_;
+    int low_bits_;
+    int64_t low_mask_;
+    std::vector<complex_t> low_;
+    std::vector<complex_t> high_;
+};
+
+// Tables are built once per width and live until the end of the program.
+const RootsOfUnity& GetRootsOfUnity(int64_t n) {
+    static std::mutex mutex;
+    static std::unordered_map<int64_t, std::unique_ptr<RootsOfUnity>> tables;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& table = tables[n];
+    if (!table) {
+        table = std::make_unique<RootsOfUnity>(n);
+    }
+    return *table;
+}
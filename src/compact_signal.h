@@ -0,0 +1,83 @@
+#pragma once
+
+#include "disfft.h"
+#include <cstdint>
+#include <cstring>
+
+// IEEE 754 half precision value kept as its bits
+struct Half {
+    uint16_t bits;
+};
+
+double SampleToDouble(int8_t value) {
+    return value;
+}
+
+double SampleToDouble(int16_t value) {
+    return value;
+}
+
+double SampleToDouble(Half value) {
+    uint32_t sign = static_cast<uint32_t>(value.bits & 0x8000) << 16;
+    uint32_t exponent = (value.bits >> 10) & 0x1f;
+    uint32_t mantissa = value.bits & 0x3ff;
+    uint32_t bits;
+    if (exponent == 0x1f) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    } else if (exponent != 0) {
+        bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    } else if (mantissa == 0) {
+        bits = sign;
+    } else {
+        // subnormal half is a normal float
+        exponent = 113;
+        while (!(mantissa & 0x400)) {
+            mantissa <<= 1;
+            --exponent;
+        }
+        bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+    }
+    float res;
+    std::memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+// Signal of interleaved real and imaginary parts stored compactly, e.g. int16 I/Q captures.
+// Samples are converted to complex_t and multiplied by scale only when read.
+// Float samples are read by FloatDataSignal, which takes a scale too.
+template <class Sample>
+class CompactSignal: public Signal {
+public:
+    CompactSignal(const SignalInfo& info, const Sample* interleaved, double scale = 1.):
+            info_(info),
+            values_(interleaved),
+            scale_(scale) {
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        return Load(key.Flatten());
+    }
+
+    complex_t ValueAtIndex(const SignalInfo&, int64_t index) const override {
+        return Load(index);
+    }
+
+    void ValuesAtIndices(const SignalInfo&, const int64_t* indices, size_t count, complex_t* out) const override {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = Load(indices[i]);
+        }
+    }
+
+private:
+    complex_t Load(int64_t index) const {
+        return {SampleToDouble(values_[2 * index]) * scale_, SampleToDouble(values_[2 * index + 1]) * scale_};
+    }
+
+    const SignalInfo info_;
+    const Sample* values_;
+    const double scale_;
+};
+
+using Int8Signal = CompactSignal<int8_t>;
+using Int16Signal = CompactSignal<int16_t>;
+using HalfSignal = CompactSignal<Half>;
@@ -1,7 +1,13 @@
 #pragma once
 
 #include "filter.h"
+#include "evaluator.h"
+#include "thread_pool.h"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <map>
+#include <mutex>
 #include <vector>
 #include <initializer_list>
 #include "random"
@@ -13,40 +19,126 @@ public:
     virtual ~Signal() = default;
 
     virtual complex_t ValueAtTime(const Key& key) const = 0;
+
+    // value at the flattened time, signals with a flat layout override it to skip building a Key
+    virtual complex_t ValueAtIndex(const SignalInfo& info, int64_t index) const {
+        return ValueAtTime(Key(info, index));
+    }
+
+    // values at count flattened times, signals that are expensive per call override it to serve them together
+    virtual void ValuesAtIndices(const SignalInfo& info, const int64_t* indices, size_t count, complex_t* out) const {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = ValueAtIndex(info, indices[i]);
+        }
+    }
+
+    // residuals below it are zero, signals of float samples override it with the precision of float
+    virtual double ZeroThreshold() const {
+        return RealTraits<double>::kEps;
+    }
 };
 
-class DataSignal: public Signal {
+// Signal of samples stored densely in the Key::Flatten order, in double or in float precision.
+// Samples are multiplied by scale when read, e.g. to undo the gain of a float32 capture.
+template <class Real>
+class BasicDataSignal: public Signal {
 public:
-    DataSignal(const SignalInfo& info, const complex_t* v):
+    BasicDataSignal(const SignalInfo& info, const std::complex<Real>* v, double scale = 1.):
             info_(info),
-            values_(v) {
+            values_(v),
+            scale_(scale) {
     }
 
     complex_t ValueAtTime(const Key& key) const override {
-        return values_[key.Flatten()];
+        return complex_t(values_[key.Flatten()]) * scale_;
+    }
+
+    complex_t ValueAtIndex(const SignalInfo&, int64_t index) const override {
+        return complex_t(values_[index]) * scale_;
+    }
+
+    void ValuesAtIndices(const SignalInfo&, const int64_t* indices, size_t count, complex_t* out) const override {
+        size_t i = 0;
+#ifdef DISFFT_X86_KERNELS
+        static const bool avx2 = __builtin_cpu_supports("avx2");
+        if (avx2) {
+            i = GatherAvx2(indices, count, out);
+        }
+#endif
+        for (; i < count; ++i) {
+            out[i] = complex_t(values_[indices[i]]) * scale_;
+        }
     }
 
-    const complex_t* Data() const {
+    const std::complex<Real>* Data() const {
         return values_;
     }
 
+    double Scale() const {
+        return scale_;
+    }
+
+    double ZeroThreshold() const override {
+        return RealTraits<Real>::kEps;
+    }
+
 private:
+#ifdef DISFFT_X86_KERNELS
+    // Gathers the real and imaginary parts of two samples at once, returns the number of samples done.
+    // Gathers are masked with a zero source, the unmasked ones read an undefined register.
+    __attribute__((target("avx2")))
+    size_t GatherAvx2(const int64_t* indices, size_t count, complex_t* out) const {
+        const Real* parts = reinterpret_cast<const Real*>(values_);
+        const __m256i imag = _mm256_setr_epi64x(0, 1, 0, 1);
+        const __m256d scale = _mm256_set1_pd(scale_);
+        size_t i = 0;
+        for (; i + 2 <= count; i += 2) {
+            __m256i pair = _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(indices + i)));
+            __m256i index = _mm256_add_epi64(_mm256_slli_epi64(_mm256_permute4x64_epi64(pair, 0x50), 1), imag);
+            __m256d values;
+            if constexpr (std::is_same_v<Real, double>) {
+                values = _mm256_mask_i64gather_pd(_mm256_setzero_pd(), parts, index, _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+            } else {
+                values = _mm256_cvtps_pd(_mm256_mask_i64gather_ps(_mm_setzero_ps(), parts, index, _mm_castsi128_ps(_mm_set1_epi32(-1)), 4));
+            }
+            _mm256_storeu_pd(reinterpret_cast<double*>(out + i), _mm256_mul_pd(values, scale));
+        }
+        return i;
+    }
+#endif
+
     const SignalInfo info_;
-    const complex_t* values_;
+    const std::complex<Real>* values_;
+    const double scale_;
 };
 
+using DataSignal = BasicDataSignal<double>;
+using FloatDataSignal = BasicDataSignal<float>;
+
 class IndexGenerator {
 public:
-    IndexGenerator(const SignalInfo& info, int64_t seed):
-        info_(info), rand_gen_(seed), index_gen_(0, info.SignalSize()) {
+    template <int D>
+    IndexGenerator(const BasicSignalInfo<D>& info, int64_t seed): IndexGenerator(info.SignalSize(), seed) {
+    }
+
+    template <int D>
+    void Next(BasicKey<D>& value) {
+        value.SetFromFlatten(NextIndex());
+    }
+
+    int64_t NextIndex() {
+        return index_gen_(rand_gen_);
     }
 
-    void Next(Key& value) {
-        value.SetFromFlatten(index_gen_(rand_gen_));
+    // independent generator seeded from this one, for a task running on another thread
+    IndexGenerator Split() {
+        return IndexGenerator(index_gen_.b(), static_cast<int64_t>(rand_gen_()));
     }
 
 private:
-    SignalInfo info_;
+    IndexGenerator(int64_t signal_size, int64_t seed): rand_gen_(seed), index_gen_(0, signal_size) {
+    }
+
     std::mt19937_64 rand_gen_;
     std::uniform_int_distribution<int64_t> index_gen_;
 };
@@ -57,106 +149,289 @@ struct TransformSettings {
     bool use_comb{true};
     bool assume_random_phase{false};
     int random_phase_sparsity_koef{1};
+    // if set, independent tests run concurrently on the pool and the signal must be safe to read from several threads
+    ThreadPool* thread_pool{nullptr};
+    // with a thread pool, also split the samples of a single ZeroTest between tasks
+    bool parallel_zero_test{false};
+    // for float samples: the comb runs in float
+    bool single_precision{false};
 };
 
-class AlignedVector {
-public:
-    AlignedVector(int n) {
-        if (n % 2 == 1) {
-            n += 1;
+const int kZeroTestMaxBatch = 8;
+// samples per task of a parallel ZeroTest
+const int64_t kZeroTestParallelChunk = 64;
+
+// Filtered signal at count times. All taps of all times are requested from the signal at once,
+// indices and samples are scratch buffers reused between calls.
+template <int D>
+void FilteredAtTimes(const Signal& x, const Filter& filter, const BasicSignalInfo<D>& info, const int64_t* times, int count,
+                     std::vector<int64_t>& indices, std::vector<complex_t>& samples, complex_t* out) {
+    const auto& offsets = filter.TapOffsets();
+    const auto& re = filter.TapReal();
+    const auto& im = filter.TapImag();
+    size_t taps = offsets.size();
+    indices.resize(taps * count);
+    samples.resize(taps * count);
+    for (int b = 0; b < count; ++b) {
+        for (size_t j = 0; j < taps; ++j) {
+            indices[b * taps + j] = info.FlatDifference(times[b], offsets[j]);
         }
-        data_ = (double *) std::aligned_alloc(16, n * sizeof(double));
-        for (int i = 0; i < n; ++i) {
-            data_[i] = 0;
+    }
+    x.ValuesAtIndices(SignalInfo(info), indices.data(), indices.size(), samples.data());
+    for (int b = 0; b < count; ++b) {
+        complex_t filtered_at_time = 0;
+        for (size_t j = 0; j < taps; ++j) {
+            filtered_at_time += complex_t(re[j], im[j]) * samples[b * taps + j];
         }
+        out[b] = filtered_at_time;
+    }
+}
+
+template <int D>
+complex_t FilteredAtTime(const Signal& x, const Filter& filter, const BasicSignalInfo<D>& info, int64_t time,
+                         std::vector<int64_t>& indices, std::vector<complex_t>& samples) {
+    complex_t filtered_at_time;
+    FilteredAtTimes(x, filter, info, &time, 1, indices, samples, &filtered_at_time);
+    return filtered_at_time;
+}
+
+// Known part of the spectrum. The log keeps additions in order, so that residuals cached in tree nodes
+// are brought up to date by subtracting only the frequencies added since.
+struct KnownFrequencies {
+    explicit KnownFrequencies(const FrequencyMap& known) : map(known) {
     }
 
-    ~AlignedVector() {
-        std::free(data_);
+    void Add(int64_t key, complex_t value) {
+        map[key] += value;
+        log.emplace_back(key, value);
     }
 
-    double& operator[](int i) {
-        return data_[i];
+    void Add(const FrequencyMap& freq) {
+        for (const auto& value : freq) {
+            Add(value.first, value.second);
+        }
     }
 
-private:
-    double* data_;
+    FrequencyMap map;
+    std::vector<std::pair<int64_t, complex_t>> log;
 };
 
-bool ZeroTest(const Signal& x, const FrequencyMap& recovered_freq, const SplittingTree& tree,
-              const SplittingTree::NodePtr& cone_node, const SignalInfo& info, int64_t sparsity, IndexGenerator& delta,
+// Draws count sample times and appends them with the residuals against the recovered frequencies to cache.
+// Stops at the first sample where the residual differs from the trial frequencies, or once stop is set.
+template <int D>
+bool SampleResiduals(const Signal& x, const Filter& filter, const SpectrumEvaluator& recovered, const SpectrumEvaluator& trial,
+                     const BasicSignalInfo<D>& info, int64_t count, IndexGenerator& delta, ResidualCache& cache,
+                     double eps, const std::atomic<bool>* stop) {
+    auto size = static_cast<double>(info.SignalSize());
+    // batches grow geometrically, so that an early nonzero sample wastes at most half of the work
+    std::array<int64_t, kZeroTestMaxBatch> times;
+    std::array<complex_t, kZeroTestMaxBatch> recovered_at_time;
+    std::array<complex_t, kZeroTestMaxBatch> trial_at_time;
+    std::array<complex_t, kZeroTestMaxBatch> filtered_at_time;
+    std::vector<int64_t> indices;
+    std::vector<complex_t> samples;
+    int batch = 1;
+
+    for (int64_t iter = 0; iter < count; iter += batch, batch = std::min(2 * batch, kZeroTestMaxBatch)) {
+        if (stop && stop->load(std::memory_order_relaxed)) {
+            return false;
+        }
+        int block = static_cast<int>(std::min<int64_t>(batch, count - iter));
+        for (int b = 0; b < block; ++b) {
+            times[b] = delta.NextIndex();
+        }
+        recovered.Evaluate(times.data(), block, recovered_at_time.data());
+        trial.Evaluate(times.data(), block, trial_at_time.data());
+        FilteredAtTimes(x, filter, info, times.data(), block, indices, samples, filtered_at_time.data());
+        for (int b = 0; b < block; ++b) {
+            auto residual = filtered_at_time[b] - recovered_at_time[b] / size;
+            cache.times.push_back(times[b]);
+            cache.residuals.push_back(residual);
+            if (NonZero(residual - trial_at_time[b] / size, eps)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// Tests whether the signal restricted to the cone of the node equals known + trial frequencies.
+// Residuals against the known frequencies are kept in cache and reused by later tests of the same node.
+template <int D>
+bool ZeroTest(const Signal& x, const FrequencyMap& known_freq, const std::vector<std::pair<int64_t, complex_t>>& known_log,
+              const FrequencyMap* trial_freq, ResidualCache& cache, const SplittingTree& tree,
+              const SplittingTree::NodePtr& cone_node, const BasicSignalInfo<D>& info, int64_t sparsity, IndexGenerator& delta,
               const TransformSettings& settings) {
-    auto filter = Filter(tree, cone_node, info);
+    auto filter_ptr = GetNodeFilter(tree, cone_node, info);
+    const Filter& filter = *filter_ptr;
+    const double eps = x.ZeroThreshold();
     int64_t max_iters = std::max<int64_t>(llround(settings.zero_test_koef * sparsity * log2(info.SignalSize())), 1);
-    std::vector<std::pair<Key, complex_t>> freq_precalc;
-    freq_precalc.reserve(recovered_freq.size());
-    for (const auto& freq: recovered_freq) {
-        freq_precalc.emplace_back(freq.first, freq.second * filter.FilterFrequency(freq.first));
+    auto size = static_cast<double>(info.SignalSize());
+    if (cache.path != filter.Path()) {
+        cache = ResidualCache{filter.Path(), {}, {}, known_log.size()};
     }
-
-    Key diff(info);
-    Key time(info);
-    AlignedVector phi(freq_precalc.size());
-    AlignedVector x_kernel(freq_precalc.size());
-    AlignedVector y_kernel(freq_precalc.size());
-    double phi_koef = 2 * PI / info.SignalWidth();
-
-    for (int64_t iter = 0; iter < max_iters; ++iter) {
-        delta.Next(time);
-        complex_t recovered_at_time = 0;
-        for (int j = 0; j < static_cast<int>(freq_precalc.size()); ++j) {
-            phi[j] = (freq_precalc[j].first * time) * phi_koef;
+    if (cache.version < known_log.size() && !cache.times.empty()) {
+        SpectrumEvaluator added(info);
+        for (size_t i = cache.version; i < known_log.size(); ++i) {
+            added.Add(known_log[i].first, known_log[i].second * filter.FilterFrequency(known_log[i].first));
         }
-        for (int j = 0; j < static_cast<int>(freq_precalc.size()); ++j) {
-            x_kernel[j] = cos(phi[j]);
-            y_kernel[j] = sin(phi[j]);
+        std::vector<complex_t> added_at_time(cache.times.size());
+        added.Evaluate(cache.times.data(), static_cast<int>(cache.times.size()), added_at_time.data());
+        for (size_t i = 0; i < cache.times.size(); ++i) {
+            cache.residuals[i] -= added_at_time[i] / size;
         }
-        for (int j = 0; j < static_cast<int>(freq_precalc.size()); ++j) {
-            recovered_at_time += complex_t(x_kernel[j], y_kernel[j]) * freq_precalc[j].second;
+    }
+    cache.version = known_log.size();
+
+    SpectrumEvaluator trial(info);
+    if (trial_freq) {
+        trial.Reserve(trial_freq->size());
+        for (const auto& freq: *trial_freq) {
+            trial.Add(freq.first, freq.second * filter.FilterFrequency(freq.first));
         }
-        recovered_at_time /= static_cast<double>(info.SignalSize());
-        complex_t filtered_at_time = 0;
-        for (const auto& value: filter.FilterTime()) {
-            diff.StoreDifference(time, value.first);
-            filtered_at_time += value.second * x.ValueAtTime(diff);
+    }
+    auto cached = static_cast<int>(std::min<int64_t>(cache.times.size(), max_iters));
+    if (cached > 0) {
+        std::vector<complex_t> trial_at_time(cached);
+        trial.Evaluate(cache.times.data(), cached, trial_at_time.data());
+        for (int i = 0; i < cached; ++i) {
+            if (NonZero(cache.residuals[i] - trial_at_time[i] / size, eps)) {
+                return true;
+            }
+        }
+    }
+
+    SpectrumEvaluator recovered(info);
+    recovered.Reserve(known_freq.size());
+    for (const auto& freq: known_freq) {
+        recovered.Add(freq.first, freq.second * filter.FilterFrequency(freq.first));
+    }
+
+    int64_t remaining = max_iters - cached;
+    if (!settings.thread_pool || !settings.parallel_zero_test || remaining <= kZeroTestParallelChunk) {
+        return SampleResiduals(x, filter, recovered, trial, info, remaining, delta, cache, eps, nullptr);
+    }
+
+    // chunks of samples run as tasks with their own streams and stop together at the first nonzero sample
+    int64_t chunks = (remaining + kZeroTestParallelChunk - 1) / kZeroTestParallelChunk;
+    std::vector<IndexGenerator> streams;
+    streams.reserve(chunks);
+    for (int64_t i = 0; i < chunks; ++i) {
+        streams.push_back(delta.Split());
+    }
+    auto chunk_size = [&](int64_t i) {
+        return std::min(kZeroTestParallelChunk, remaining - i * kZeroTestParallelChunk);
+    };
+    std::vector<ResidualCache> sampled(chunks);
+    std::vector<char> nonzero(chunks, false);
+    std::atomic<bool> found{false};
+    ThreadPool::TaskGroup group(settings.thread_pool);
+    for (int64_t i = 0; i < chunks; ++i) {
+        group.Run([&, i] {
+            if (SampleResiduals(x, filter, recovered, trial, info, chunk_size(i), streams[i], sampled[i], eps, &found)) {
+                nonzero[i] = true;
+                found.store(true, std::memory_order_relaxed);
+            }
+        });
+    }
+    group.Wait();
+    // The cache gets the chunks up to the first one with a nonzero sample, as if they were sampled in order,
+    // so that its size and the streams split by later tests do not depend on scheduling. Chunks stopped by
+    // the others before finishing resume their streams, the stop is checked between batches only.
+    for (int64_t i = 0; i < chunks; ++i) {
+        auto drawn = static_cast<int64_t>(sampled[i].times.size());
+        if (!nonzero[i] && drawn < chunk_size(i)) {
+            nonzero[i] = SampleResiduals(x, filter, recovered, trial, info, chunk_size(i) - drawn, streams[i], sampled[i], eps, nullptr);
         }
-        if (NonZero(filtered_at_time - recovered_at_time)) {
+        cache.times.insert(cache.times.end(), sampled[i].times.begin(), sampled[i].times.end());
+        cache.residuals.insert(cache.residuals.end(), sampled[i].residuals.begin(), sampled[i].residuals.end());
+        if (nonzero[i]) {
             return true;
         }
     }
     return false;
 }
 
-std::optional<FrequencyMap> SparseFFT(const Signal& x, const SignalInfo& info, int64_t expected_sparsity, SplittingTree* parent_tree,
-                       SplittingTree::NodePtr& parent_node, const FrequencyMap& known_freq, IndexGenerator& delta, const TransformSettings& settings) {
+template <int D>
+bool ZeroTest(const Signal& x, const KnownFrequencies& known, const FrequencyMap* trial_freq,
+              const SplittingTree& tree, const SplittingTree::NodePtr& cone_node, const BasicSignalInfo<D>& info, int64_t sparsity,
+              IndexGenerator& delta, const TransformSettings& settings) {
+    return ZeroTest(x, known.map, known.log, trial_freq, cone_node->residuals, tree, cone_node, info, sparsity, delta, settings);
+}
+
+template <int D>
+bool ZeroTest(const Signal& x, const FrequencyMap& recovered_freq, const SplittingTree& tree,
+              const SplittingTree::NodePtr& cone_node, const BasicSignalInfo<D>& info, int64_t sparsity, IndexGenerator& delta,
+              const TransformSettings& settings) {
+    ResidualCache cache;
+    return ZeroTest(x, recovered_freq, {}, nullptr, cache, tree, cone_node, info, sparsity, delta, settings);
+}
+
+// Tests the nodes concurrently on the thread pool of the settings. Filters are memoized beforehand,
+// and every test samples from its own generator split from delta in node order, so the results
+// do not depend on scheduling. Returns whether each node is nonzero.
+template <int D, size_t N>
+std::array<bool, N> ZeroTestAll(const Signal& x, const KnownFrequencies& known, const SplittingTree& tree,
+                                const std::array<NodePtr, N>& nodes, const BasicSignalInfo<D>& info, int64_t sparsity,
+                                IndexGenerator& delta, const TransformSettings& settings) {
+    std::array<bool, N> nonzero{};
+    std::vector<IndexGenerator> streams;
+    streams.reserve(N);
+    for (const auto& node : nodes) {
+        GetNodeFilter(tree, node, info);
+        streams.push_back(delta.Split());
+    }
+    ThreadPool::TaskGroup group(settings.thread_pool);
+    for (size_t i = 0; i < N; ++i) {
+        group.Run([&, i] {
+            nonzero[i] = ZeroTest(x, known, nullptr, tree, nodes[i], info, sparsity, streams[i], settings);
+        });
+    }
+    group.Wait();
+    return nonzero;
+}
+
+template <int D>
+std::optional<FrequencyMap> SparseFFT(const Signal& x, const BasicSignalInfo<D>& info, int64_t expected_sparsity, const SplittingTree* parent_tree,
+                       const SplittingTree::NodePtr& parent_node, const FrequencyMap& known_freq, IndexGenerator& delta, const TransformSettings& settings,
+                       SplittingTree::NodePools* pools = nullptr) {
     FrequencyMap recovered_freq;
-    FrequencyMap total_freq = known_freq;
-    SplittingTree tree(parent_tree, parent_node);
+    KnownFrequencies total_freq(known_freq);
+    SplittingTree tree(parent_tree, parent_node, pools);
+    std::vector<int64_t> leaf_indices;
+    std::vector<complex_t> leaf_samples;
 
     while (!tree.IsEmpty() && (settings.assume_random_phase || (tree.LeavesCount() + static_cast<int>(recovered_freq.size())) <= expected_sparsity)) {
         NodePtr node = tree.GetLightestNode();
         if (node->level == info.Dimensions() * info.LogSignalWidth()) {
-            auto filter = Filter(tree, node, info);
+            auto filter_ptr = GetNodeFilter(tree, node, info);
+            const Filter& filter = *filter_ptr;
             complex_t recovered = 0;
-            for (const auto& freq : total_freq) {
+            for (const auto& freq : total_freq.map) {
                 recovered += freq.second * filter.FilterFrequency(freq.first);
             }
-            complex_t filtered = 0;
-            for (const auto& value : filter.FilterTime()) {
-                filtered += value.second * x.ValueAtTime(-value.first);
-            }
+            complex_t filtered = FilteredAtTime(x, filter, info, 0, leaf_indices, leaf_samples);
             auto value = static_cast<double>(info.SignalSize()) * filtered - recovered;
-            auto key = Key(info, node->label);
+            auto key = node->label;
             recovered_freq[key] += value;
-            total_freq[key] += value;
+            total_freq.Add(key, value);
             tree.RemoveNode(node);
+        } else if (settings.thread_pool) {
+            auto children = node->AddChildren();
+            std::array<NodePtr, 2> nodes{children.first, children.second};
+            auto nonzero = ZeroTestAll(x, total_freq, tree, nodes, info, expected_sparsity, delta, settings);
+            for (size_t i = 0; i < nodes.size(); ++i) {
+                if (!nonzero[i]) {
+                    tree.RemoveNode(nodes[i]);
+                }
+            }
         } else {
             node->AddChildren();
-            if (!ZeroTest(x, total_freq, tree, node->left, info, expected_sparsity, delta, settings)) {
-                tree.RemoveNode(node->left);
+            if (!ZeroTest(x, total_freq, nullptr, tree, node->Left(), info, expected_sparsity, delta, settings)) {
+                tree.RemoveNode(node->Left());
             }
-            if (!ZeroTest(x, total_freq, tree, node->right, info, expected_sparsity, delta, settings)) {
-                tree.RemoveNode(node->right);
+            if (!ZeroTest(x, total_freq, nullptr, tree, node->Right(), info, expected_sparsity, delta, settings)) {
+                tree.RemoveNode(node->Right());
             }
         }
     }
@@ -168,12 +443,14 @@ std::optional<FrequencyMap> SparseFFT(const Signal& x, const SignalInfo& info, i
     return recovered_freq;
 }
 
-class Restorer {
+template <int D>
+class BasicRestorer {
 public:
-    Restorer(const SplittingTree* parent_tree, SplittingTree::NodePtr& parent_node, const FrequencyMap& known_freq)
-        : recovered_freq_(), total_freq_(known_freq), tree_(parent_tree, parent_node) {}
+    BasicRestorer(const SplittingTree* parent_tree, const SplittingTree::NodePtr& parent_node, const FrequencyMap& known_freq,
+                  SplittingTree::NodePools* pools = nullptr)
+        : recovered_freq_(), total_freq_(known_freq), tree_(parent_tree, parent_node, pools) {}
 
-    std::optional<FrequencyMap> TryRestore(const Signal& x, const SignalInfo& info, const std::vector<int>& sparsities,
+    std::optional<FrequencyMap> TryRestore(const Signal& x, const BasicSignalInfo<D>& info, const std::vector<int>& sparsities,
                                            int rank, IndexGenerator& delta, const TransformSettings& settings) {
 
         int64_t expected_sparsity = sparsities[rank - 1];
@@ -191,17 +468,27 @@ public:
                 }
             } else {
                 v->AddChildren();
-                std::array<NodePtr, 2> children({v->left, v->right});
+                std::array<NodePtr, 2> children({v->Left(), v->Right()});
                 bool skip_restore = false;
-                if (settings.use_preemptive_tests) {
+                if (settings.use_preemptive_tests && settings.thread_pool) {
+                    auto nonzero = ZeroTestAll(x, total_freq_, tree_, children, info, expected_sparsity, delta, settings);
+                    for (size_t i = 0; i < children.size(); ++i) {
+                        if (!nonzero[i]) {
+                            skip_restore = true;
+                            tree_.RemoveNode(children[i]);
+                        }
+                    }
+                } else if (settings.use_preemptive_tests) {
                     for (auto& node : children) {
-                        if (!ZeroTest(x, total_freq_, tree_, node, info, expected_sparsity, delta, settings)) {
+                        if (!ZeroTest(x, total_freq_, nullptr, tree_, node, info, expected_sparsity, delta, settings)) {
                             skip_restore = true;
                             tree_.RemoveNode(node);
                         }
                     }
                 }
-                if (!skip_restore) {
+                if (!skip_restore && settings.thread_pool) {
+                    SparsityTestAll(x, info, expected_sparsity, sparsities, children, rank, delta, settings);
+                } else if (!skip_restore) {
                     for (auto& node : children) {
                         SparsityTest(x, info, expected_sparsity, sparsities, node, rank, delta, settings);
                     }
@@ -215,32 +502,69 @@ public:
     }
 
 private:
-    void SparsityTest(const Signal& x, const SignalInfo& info, int64_t expected_sparsity, const std::vector<int>& sparsities,
+    void SparsityTest(const Signal& x, const BasicSignalInfo<D>& info, int64_t expected_sparsity, const std::vector<int>& sparsities,
                                            SplittingTree::NodePtr& node, int rank, IndexGenerator& delta, const TransformSettings& settings) {
-        std::optional<FrequencyMap> probable_freq(std::nullopt);
+        auto probable_freq = RestoreNode(x, info, sparsities, node, rank, delta, settings);
+        AcceptIfVerified(x, info, expected_sparsity, node, probable_freq, delta, settings);
+    }
+
+    // Nested solves of the nodes run as tasks against the same known frequencies, every one with
+    // its own sample stream. Results are verified and merged in node order, so they do not depend
+    // on scheduling. The nodes are disjoint cones, so the frequencies found in one of them do not
+    // change the others.
+    template <size_t N>
+    void SparsityTestAll(const Signal& x, const BasicSignalInfo<D>& info, int64_t expected_sparsity, const std::vector<int>& sparsities,
+                         std::array<NodePtr, N>& nodes, int rank, IndexGenerator& delta, const TransformSettings& settings) {
+        std::array<std::optional<FrequencyMap>, N> probable_freq;
+        std::vector<IndexGenerator> streams;
+        streams.reserve(N);
+        for (const auto& node : nodes) {
+            // nested trees only read the memoized path and filter of their parent node
+            tree_.GetRootPath(node);
+            GetNodeFilter(tree_, node, info);
+            streams.push_back(delta.Split());
+        }
+        ThreadPool::TaskGroup group(settings.thread_pool);
+        for (size_t i = 0; i < N; ++i) {
+            group.Run([&, i] {
+                probable_freq[i] = RestoreNode(x, info, sparsities, nodes[i], rank, streams[i], settings);
+            });
+        }
+        group.Wait();
+        for (size_t i = 0; i < N; ++i) {
+            AcceptIfVerified(x, info, expected_sparsity, nodes[i], probable_freq[i], delta, settings);
+        }
+    }
+
+    // solves the problem of the lower rank in the cone of the node, reads only the tree and total_freq_
+    std::optional<FrequencyMap> RestoreNode(const Signal& x, const BasicSignalInfo<D>& info, const std::vector<int>& sparsities,
+                                            const NodePtr& node, int rank, IndexGenerator& delta, const TransformSettings& settings) const {
         if (rank == 2) {
-            probable_freq = SparseFFT(x, info, next_sparsity_, &tree_, node, total_freq_, delta, settings);
-        } else {
-            Restorer restorer(&tree_, node, total_freq_);
-            probable_freq = restorer.TryRestore(x, info, sparsities, rank - 1,
-                                                delta, settings);
+            return SparseFFT(x, info, next_sparsity_, &tree_, node, total_freq_.map, delta, settings);
         }
+        BasicRestorer restorer(&tree_, node, total_freq_.map);
+        return restorer.TryRestore(x, info, sparsities, rank - 1, delta, settings);
+    }
+
+    void AcceptIfVerified(const Signal& x, const BasicSignalInfo<D>& info, int64_t expected_sparsity, NodePtr& node,
+                          std::optional<FrequencyMap>& probable_freq, IndexGenerator& delta, const TransformSettings& settings) {
         if (probable_freq) {
-            auto new_total_freq = MapUnion(probable_freq.value(), total_freq_);
-            if (!ZeroTest(x, new_total_freq, tree_, node, info, expected_sparsity, delta, settings)) {
+            if (!ZeroTest(x, total_freq_, &probable_freq.value(), tree_, node, info, expected_sparsity, delta, settings)) {
                 tree_.RemoveNode(node);
-                recovered_freq_ = MapUnion(recovered_freq_, probable_freq.value());
-                total_freq_.swap(new_total_freq);
+                total_freq_.Add(probable_freq.value());
+                recovered_freq_.Merge(std::move(probable_freq.value()));
             }
         }
     }
 
     FrequencyMap recovered_freq_;
-    FrequencyMap total_freq_;
+    KnownFrequencies total_freq_;
     int64_t next_sparsity_;
     SplittingTree tree_;
 };
 
+using Restorer = BasicRestorer<kDynamicDimensions>;
+
 std::vector<int> PrepareCombSizes(int n, int d, int k) {
     const double Comb_cst = 10;
     std::vector<int> W_Combs(d);
@@ -255,108 +579,297 @@ std::vector<int> PrepareCombSizes(int n, int d, int k) {
     return W_Combs;
 }
 
-void ComputeCombBucketedSignal(int n, int d, int lvl, const Key& a, int* W_Combs, int* u_index, Key& in_index, const Signal& in, complex_t* u) {
-    if (lvl < d) {
-        int step = n / W_Combs[lvl];
-        for (int h = 0; h < W_Combs[lvl]; ++h) {
-            u_index[lvl] = h;
-            in_index[lvl] = (h * step + a[lvl]) & (n - 1);
-            ComputeCombBucketedSignal(n, d, lvl + 1, a, W_Combs, u_index, in_index, in, u);
+// Flattened times of one run of the comb along the first dimension. The run starts at base + shift
+// and wraps around the signal width after wrap samples.
+void CombRunTimes(int64_t base, int64_t shift, int64_t step, int64_t width, int64_t count, int64_t wrap, int64_t* times) {
+    int64_t time = base + shift;
+    for (int64_t h = 0; h < wrap; ++h, time += step) {
+        times[h] = time;
+    }
+    time -= width;
+    for (int64_t h = wrap; h < count; ++h, time += step) {
+        times[h] = time;
+    }
+}
+
+// Samples of the comb with shift a added to the buckets u, converted to the precision of the comb.
+template <int D, class Real>
+void ComputeCombBucketedSignal(const BasicSignalInfo<D>& info, const BasicKey<D>& a, const int* W_Combs, const Signal& in, std::complex<Real>* u) {
+    int d = info.Dimensions();
+    int64_t n = info.SignalWidth();
+    // buckets are row major for fftw (the last dimension is the fastest) while times are flattened
+    // with the first dimension fastest, so runs go along the first dimension and write to u with a stride
+    int64_t stride = 1;
+    for (int i = 1; i < d; ++i) {
+        stride *= W_Combs[i];
+    }
+    int64_t step = n / W_Combs[0];
+    int64_t wrap = std::min<int64_t>(W_Combs[0], (n - a[0] + step - 1) / step);
+    std::vector<int> h(d, 0);
+    const SignalInfo signal_info(info);
+    const auto* data_signal = dynamic_cast<const DataSignal*>(&in);
+    std::vector<int64_t> times(W_Combs[0]);
+    std::vector<complex_t> samples(W_Combs[0]);
+    for (int64_t bucket = 0; bucket < stride; ++bucket) {
+        int64_t base = 0;
+        for (int i = 1; i < d; ++i) {
+            int64_t time = (h[i] * (n / W_Combs[i]) + a[i]) & (n - 1);
+            base |= time << (i * info.LogSignalWidth());
         }
-    } else {
-        // dimension order for ffrw is row major (different from Key order)
-        int flatten = 0;
-        for (int i = 0; i < d; ++i) {
-            flatten = flatten * W_Combs[i] + u_index[i];
+        CombRunTimes(base, a[0], step, n, W_Combs[0], wrap, times.data());
+        std::complex<Real>* out = u + bucket;
+        if (data_signal) {
+            const complex_t* values = data_signal->Data();
+            double scale = data_signal->Scale();
+            for (int64_t j = 0; j < W_Combs[0]; ++j) {
+                out[j * stride] += std::complex<Real>(values[times[j]] * scale);
+            }
+        } else {
+            in.ValuesAtIndices(signal_info, times.data(), times.size(), samples.data());
+            for (int64_t j = 0; j < W_Combs[0]; ++j) {
+                out[j * stride] += std::complex<Real>(samples[j]);
+            }
+        }
+        for (int i = d - 1; i > 0 && ++h[i] == W_Combs[i]; --i) {
+            h[i] = 0;
         }
-        u[flatten] += in.ValueAtTime(in_index);
     }
 }
 
-void HashToBinsComb(const SignalInfo& info, const Signal& in, const Key& a, int W_total, int* W_Combs, complex_t* u, const fftw_plan& p) {
-    std::vector<int> u_index(info.Dimensions(), 0);
-    Key in_index(info);
-    for (int i = 0; i < W_total; ++i) {
-        u[i] = 0;
+// FFTW interface of the given precision, the comb runs in double or in float with fftwf
+template <class Real>
+struct Fftw;
+
+template <>
+struct Fftw<double> {
+    using Complex = fftw_complex;
+    using Plan = fftw_plan;
+
+    static void* Malloc(size_t size) {
+        return fftw_malloc(size);
+    }
+
+    static void Free(void* data) {
+        fftw_free(data);
+    }
+
+    // in place forward transforms of howmany arrays dist apart
+    static Plan PlanMany(int rank, const int* n, int howmany, Complex* data, int dist) {
+        return fftw_plan_many_dft(rank, n, howmany, data, nullptr, 1, dist, data, nullptr, 1, dist, FFTW_FORWARD, FFTW_ESTIMATE);
+    }
+
+    static void Execute(Plan plan, Complex* data) {
+        fftw_execute_dft(plan, data, data);
+    }
+
+    static void Destroy(Plan plan) {
+        fftw_destroy_plan(plan);
+    }
+};
+
+template <>
+struct Fftw<float> {
+    using Complex = fftwf_complex;
+    using Plan = fftwf_plan;
+
+    static void* Malloc(size_t size) {
+        return fftwf_malloc(size);
+    }
+
+    static void Free(void* data) {
+        fftwf_free(data);
+    }
+
+    static Plan PlanMany(int rank, const int* n, int howmany, Complex* data, int dist) {
+        return fftwf_plan_many_dft(rank, n, howmany, data, nullptr, 1, dist, data, nullptr, 1, dist, FFTW_FORWARD, FFTW_ESTIMATE);
+    }
+
+    static void Execute(Plan plan, Complex* data) {
+        fftwf_execute_dft(plan, data, data);
     }
-    ComputeCombBucketedSignal(info.SignalWidth(), info.Dimensions(), 0, a, W_Combs, u_index.data(), in_index, in, u);
-    fftw_execute(p);
+
+    static void Destroy(Plan plan) {
+        fftwf_destroy_plan(plan);
+    }
+};
+
+// FFTW plans of the comb filtration, one per shape of the comb, each transforms the d + 1 shifted
+// hashes laid out one after another as a single batch. Planning in FFTW is not thread safe and is
+// done under a lock, executing a plan on other arrays is thread safe.
+template <class Real>
+class CombPlans {
+public:
+    using Plan = typename Fftw<Real>::Plan;
+
+    static Plan Get(const std::vector<int>& w_combs) {
+        static CombPlans cache;
+        std::lock_guard<std::mutex> lock(cache.mutex_);
+        auto& plan = cache.plans_[w_combs];
+        if (!plan) {
+            plan = MakePlan(w_combs);
+        }
+        return plan;
+    }
+
+    // buffer of the calling thread for the hashes, kept between transforms
+    static std::complex<Real>* Buffer(size_t size) {
+        static thread_local BufferHolder buffer;
+        if (buffer.size < size) {
+            Fftw<Real>::Free(buffer.data);
+            buffer.data = (std::complex<Real>*) Fftw<Real>::Malloc(sizeof(typename Fftw<Real>::Complex) * size);
+            buffer.size = size;
+        }
+        return buffer.data;
+    }
+
+    CombPlans(const CombPlans&) = delete;
+    CombPlans& operator=(const CombPlans&) = delete;
+
+    ~CombPlans() {
+        for (auto& plan : plans_) {
+            Fftw<Real>::Destroy(plan.second);
+        }
+    }
+
+private:
+    struct BufferHolder {
+        ~BufferHolder() {
+            Fftw<Real>::Free(data);
+        }
+
+        std::complex<Real>* data{nullptr};
+        size_t size{0};
+    };
+
+    CombPlans() = default;
+
+    static Plan MakePlan(const std::vector<int>& w_combs) {
+        int d = w_combs.size();
+        int total = 1;
+        for (int w : w_combs) {
+            total *= w;
+        }
+        // FFTW_ESTIMATE does not touch the arrays, the plan is executed on the buffers of the callers
+        using Complex = typename Fftw<Real>::Complex;
+        auto* buffer = (Complex*) Fftw<Real>::Malloc(sizeof(Complex) * total * (d + 1));
+        auto plan = Fftw<Real>::PlanMany(d, w_combs.data(), d + 1, buffer, total);
+        Fftw<Real>::Free(buffer);
+        return plan;
+    }
+
+    std::mutex mutex_;
+    std::map<std::vector<int>, Plan> plans_;
+};
+
+template <int D, class Real>
+void HashToBinsComb(const BasicSignalInfo<D>& info, const Signal& in, const BasicKey<D>& a, int W_total, const int* W_Combs, std::complex<Real>* u) {
     for (int i = 0; i < W_total; ++i) {
-        u[i] *= info.SignalSize() / W_total;
+        u[i] = 0;
     }
+    ComputeCombBucketedSignal(info, a, W_Combs, in, u);
 }
 
-int RestoreFrequencies(const SignalInfo& info, int Btotal, const Key& ai, const std::vector<complex_t*>& u, FrequencyMap& out) {
-    Key i(info);
+template <int D, class Real>
+int RestoreFrequencies(const BasicSignalInfo<D>& info, int Btotal, const BasicKey<D>& ai, std::complex<Real>* const* u, double eps,
+                       FrequencyMap& out) {
+    BasicKey<D> i(info);
     int cnt = 0;
     for (int j = 0; j < Btotal; ++j) {
-        if (NonZero(u[0][j])) {
+        complex_t value(u[0][j]);
+        if (NonZero(value, eps)) {
             ++cnt;
             i.SetZero();
             for (int h = 0; h < info.Dimensions(); ++h) {
-                complex_t alpha = u[0][j] / u[h + 1][j];
+                complex_t alpha = value / complex_t(u[h + 1][j]);
                 i[h] = (((int64_t) ai[h]) * lround(std::arg(alpha) * info.SignalWidth() / (2 * M_PI))) & (info.SignalWidth() - 1);
                 if (i[h] < 0) {
                     i[h] += info.SignalWidth();
                 }
             }
-            out[i] += u[0][j];
+            out[i] += value;
         }
     }
     return cnt;
 }
 
-int CombFiltration(const Signal& x, const SignalInfo& info, int64_t sparsity, FrequencyMap& out) {
+// Signal independent part of the comb filtration: bucket counts of the comb and the batched FFTW plan
+// of the precision the comb runs in, the plan of the other precision is null.
+struct CombSetup {
+    size_t BufferSize() const {
+        return static_cast<size_t>(total) * (sizes.size() + 1);
+    }
+
+    std::vector<int> sizes;
+    int total{1};
+    Fftw<double>::Plan plan{nullptr};
+    Fftw<float>::Plan plan_float{nullptr};
+};
+
+CombSetup PrepareComb(int64_t n, int d, int64_t sparsity, bool single_precision = false) {
+    CombSetup comb;
+    comb.sizes = PrepareCombSizes(n, d, sparsity);
+    for (int size : comb.sizes) {
+        comb.total *= size;
+    }
+    if (single_precision) {
+        comb.plan_float = CombPlans<float>::Get(comb.sizes);
+    } else {
+        comb.plan = CombPlans<double>::Get(comb.sizes);
+    }
+    return comb;
+}
+
+template <class Real, int D>
+int CombFiltrationIn(const Signal& x, const BasicSignalInfo<D>& info, const CombSetup& comb, typename Fftw<Real>::Plan plan, FrequencyMap& out) {
     int n = info.SignalWidth();
     int d = info.Dimensions();
-    int WCombTotal = 1;
-    auto W_Combs = PrepareCombSizes(n, d, sparsity);
-    for (int i = 0; i < d; ++i) {
-        WCombTotal *= W_Combs[i];
-    }
-    std::vector<complex_t*> u(d + 1);
+    int WCombTotal = comb.total;
+    std::complex<Real>* buffer = CombPlans<Real>::Buffer(comb.BufferSize());
+    assert(d <= kMaxDimensions);
+    std::array<std::complex<Real>*, kMaxDimensions + 1> u;
     for (int i = 0; i < d + 1; ++i) {
-        u[i] = (complex_t*) fftw_malloc(sizeof(fftw_complex) * WCombTotal);
+        u[i] = buffer + static_cast<size_t>(WCombTotal) * i;
     }
-    Key c(info);
+    BasicKey<D> c(info);
     for (int i = 0; i < d + 1; ++i) {
         if (i > 0) {
             c[i - 1] = n - 1;
         }
-        fftw_plan plan = fftw_plan_dft(d, W_Combs.data(), reinterpret_cast<fftw_complex*>(u[i]), reinterpret_cast<fftw_complex*>(u[i]), FFTW_FORWARD, FFTW_ESTIMATE);
-        HashToBinsComb(info, x, c, WCombTotal, W_Combs.data(), u[i], plan);
-        fftw_destroy_plan(plan);
+        HashToBinsComb(info, x, c, WCombTotal, comb.sizes.data(), u[i]);
         if (i > 0) {
             c[i - 1] = 0;
         }
     }
-    Key ai(info);
+    Fftw<Real>::Execute(plan, reinterpret_cast<typename Fftw<Real>::Complex*>(buffer));
+    auto scale = static_cast<Real>(info.SignalSize() / WCombTotal);
+    for (int64_t i = 0; i < static_cast<int64_t>(comb.BufferSize()); ++i) {
+        buffer[i] *= scale;
+    }
+    BasicKey<D> ai(info);
     for (int i = 0; i < d; ++i) {
         ai[i] = 1;
     }
-    auto cnt = RestoreFrequencies(info, WCombTotal, ai, u, out);
-    for (int i = 0; i < d + 1; ++i) {
-        fftw_free(u[i]);
-    }
+    // buckets are as precise as the comb and the samples
+    double eps = std::max(RealTraits<Real>::kEps, x.ZeroThreshold());
+    auto cnt = RestoreFrequencies(info, WCombTotal, ai, u.data(), eps, out);
     return cnt;
 }
 
-FrequencyMap RecursiveSparseFFT(const Signal& x, const SignalInfo& info, int64_t sparsity, int rank, int64_t seed = 61, TransformSettings settings = {}) {
-    assert(info.SignalSize() > 1);
-    if (sparsity == 0) {
-        return {};
-    }
-    FrequencyMap prefiltered;
-    if (settings.use_comb) {
-        CombFiltration(x, info, sparsity, prefiltered);
-        sparsity += prefiltered.size();
-    }
-    IndexGenerator delta(info, seed);
-    NodePtr parent(nullptr);
-    if (settings.assume_random_phase) {
-        rank = 1;
-        sparsity = std::min<int64_t>(sparsity, settings.random_phase_sparsity_koef);
+template <int D>
+int CombFiltration(const Signal& x, const BasicSignalInfo<D>& info, const CombSetup& comb, FrequencyMap& out) {
+    if (comb.plan_float) {
+        return CombFiltrationIn<float>(x, info, comb, comb.plan_float, out);
     }
+    return CombFiltrationIn<double>(x, info, comb, comb.plan, out);
+}
+
+template <int D>
+int CombFiltration(const Signal& x, const BasicSignalInfo<D>& info, int64_t sparsity, FrequencyMap& out) {
+    return CombFiltration(x, info, PrepareComb(info.SignalWidth(), info.Dimensions(), sparsity), out);
+}
+
+// sparsities of the levels of the Restorer, growing geometrically up to sparsity at the last one
+std::vector<int> SparsitySchedule(int64_t sparsity, int rank) {
     double step = pow(sparsity / 1.0, 1. / rank);
     std::vector<int> sparsities(rank);
     sparsities[rank - 1] = sparsity;
@@ -365,16 +878,204 @@ FrequencyMap RecursiveSparseFFT(const Signal& x, const SignalInfo& info, int64_t
         curspars /= step;
         sparsities[i] = std::max<int>(1, int(curspars));
     }
-    std::optional<FrequencyMap> res;
-    if (rank == 1) {
-        res = SparseFFT(x, info, sparsity, nullptr, parent, prefiltered, delta, settings);
+    return sparsities;
+}
+
+// rank and sparsities of the tree search
+struct SearchSchedule {
+    int rank{1};
+    int64_t sparsity{0};
+    std::vector<int> sparsities;
+};
+
+SearchSchedule PrepareSearch(int64_t sparsity, int rank, const TransformSettings& settings) {
+    if (settings.assume_random_phase) {
+        rank = 1;
+        sparsity = std::min<int64_t>(sparsity, settings.random_phase_sparsity_koef);
+    }
+    return {rank, sparsity, SparsitySchedule(sparsity, rank)};
+}
+
+// Signal independent setup of a transform. With the comb the search depends on the number
+// of frequencies found by the comb and is scheduled per signal.
+struct TransformSetup {
+    std::optional<CombSetup> comb;
+    SearchSchedule search;
+};
+
+TransformSetup PrepareTransform(int64_t n, int d, int64_t sparsity, int rank, const TransformSettings& settings) {
+    TransformSetup setup;
+    if (settings.use_comb) {
+        setup.comb = PrepareComb(n, d, sparsity, settings.single_precision);
     } else {
-        Restorer restorer(nullptr, parent, prefiltered);
-        res = restorer.TryRestore(x, info, sparsities, rank, delta, settings);
+        setup.search = PrepareSearch(sparsity, rank, settings);
+    }
+    return setup;
+}
+
+template <int D>
+std::optional<FrequencyMap> SearchFrequencies(const Signal& x, const BasicSignalInfo<D>& info, const SearchSchedule& search,
+                                              const FrequencyMap& known, IndexGenerator& delta, const TransformSettings& settings,
+                                              SplittingTree::NodePools* pools = nullptr) {
+    NodePtr parent(nullptr);
+    if (search.rank == 1) {
+        return SparseFFT(x, info, search.sparsity, nullptr, parent, known, delta, settings, pools);
+    }
+    BasicRestorer<D> restorer(nullptr, parent, known, pools);
+    return restorer.TryRestore(x, info, search.sparsities, search.rank, delta, settings);
+}
+
+FrequencyMap DropZeros(const FrequencyMap& freq, double eps) {
+    FrequencyMap nonzero;
+    nonzero.reserve(freq.size());
+    for (const auto& value : freq) {
+        if (NonZero(value.second, eps)) {
+            nonzero.emplace(value.first, value.second);
+        }
     }
+    return nonzero;
+}
+
+template <int D>
+FrequencyMap TransformPrepared(const Signal& x, const BasicSignalInfo<D>& info, const TransformSetup& setup, int64_t sparsity, int rank,
+                               int64_t seed, const TransformSettings& settings, SplittingTree::NodePools* pools = nullptr) {
+    FrequencyMap prefiltered;
+    IndexGenerator delta(info, seed);
+    const SearchSchedule* search = &setup.search;
+    SearchSchedule comb_search;
+    if (setup.comb) {
+        CombFiltration(x, info, *setup.comb, prefiltered);
+        comb_search = PrepareSearch(sparsity + prefiltered.size(), rank, settings);
+        search = &comb_search;
+    }
+    auto res = SearchFrequencies(x, info, *search, prefiltered, delta, settings, pools);
     if (!res) {
         return prefiltered;
     }
 
-    return MapUnion(prefiltered, res.value());
-}
\ No newline at end of file
+    prefiltered.Merge(std::move(res.value()));
+    // wrong frequencies of the comb are cancelled by the search, with float samples or a float comb up to float rounding
+    double eps = std::max(x.ZeroThreshold(), settings.single_precision ? RealTraits<float>::kEps : RealTraits<double>::kEps);
+    if (setup.comb && eps > RealTraits<double>::kEps) {
+        return DropZeros(prefiltered, eps);
+    }
+    return prefiltered;
+}
+
+// With a hint the transform starts from the hinted spectrum instead of the comb filtration and searches
+// only for the frequencies where the signal differs from it, at most sparsity of them.
+template <int D>
+FrequencyMap RecursiveSparseFFTImpl(const Signal& x, const BasicSignalInfo<D>& info, int64_t sparsity, int rank, int64_t seed,
+                                            const TransformSettings& settings, const FrequencyMap* hint = nullptr) {
+    if (!hint) {
+        auto setup = PrepareTransform(info.SignalWidth(), info.Dimensions(), sparsity, rank, settings);
+        return TransformPrepared(x, info, setup, sparsity, rank, seed, settings);
+    }
+    FrequencyMap prefiltered = *hint;
+    IndexGenerator delta(info, seed);
+    {
+        SplittingTree tree;
+        KnownFrequencies known(prefiltered);
+        if (!ZeroTest(x, known, nullptr, tree, tree.GetRoot(), info, sparsity, delta, settings)) {
+            return prefiltered;
+        }
+    }
+    auto res = SearchFrequencies(x, info, PrepareSearch(sparsity, rank, settings), prefiltered, delta, settings);
+    if (!res) {
+        // the signal is too far from the hint
+        return RecursiveSparseFFTImpl(x, info, sparsity + hint->size(), rank, seed, settings);
+    }
+
+    prefiltered.Merge(std::move(res.value()));
+    // frequencies of the hint missing in the signal are cancelled by the found difference
+    return DropZeros(prefiltered, x.ZeroThreshold());
+}
+
+// calls transform(info) with the number of dimensions fixed at compile time when it is at most kMaxStaticDimensions
+template <int D = 1, class F>
+auto DispatchDimensions(const SignalInfo& info, F&& transform) {
+    if constexpr (D > kMaxStaticDimensions) {
+        return transform(info);
+    } else {
+        if (info.Dimensions() != D) {
+            return DispatchDimensions<D + 1>(info, std::forward<F>(transform));
+        }
+        return transform(BasicSignalInfo<D>(info));
+    }
+}
+
+FrequencyMap RecursiveSparseFFT(const Signal& x, const SignalInfo& info, int64_t sparsity, int rank, int64_t seed = 61, TransformSettings settings = {}) {
+    assert(info.SignalSize() > 1);
+    if (sparsity == 0) {
+        return {};
+    }
+    return DispatchDimensions(info, [&](const auto& static_info) {
+        return RecursiveSparseFFTImpl(x, static_info, sparsity, rank, seed, settings);
+    });
+}
+
+// Transform of a signal whose spectrum is close to hint, e.g. the spectrum of the previous frame.
+// The hint is verified against the signal and only the frequencies where they differ are searched for,
+// sparsity bounds their number. A signal too far from the hint is transformed from scratch.
+FrequencyMap WarmStartSparseFFT(const Signal& x, const SignalInfo& info, const FrequencyMap& hint, int64_t sparsity, int rank,
+                                int64_t seed = 61, TransformSettings settings = {}) {
+    assert(info.SignalSize() > 1);
+    return DispatchDimensions(info, [&](const auto& static_info) {
+        return RecursiveSparseFFTImpl(x, static_info, std::max<int64_t>(sparsity, 1), rank, seed, settings, &hint);
+    });
+}
+
+// Transform with the signal independent setup done once, after the plan and execute split of FFTW.
+// The plan holds the signal info with its twiddle tables, the comb sizes and FFTW plan, and without
+// the comb the schedule of the tree search. Execute may be called concurrently, comb buffers are per thread.
+// The node arenas of the search trees are kept by the plan and reused by the following executions.
+class SparseFFTPlan {
+public:
+    SparseFFTPlan(const SignalInfo& info, int64_t sparsity, int rank, TransformSettings settings = {}):
+            info_(info),
+            sparsity_(sparsity),
+            rank_(rank),
+            settings_(settings) {
+        assert(info.SignalSize() > 1);
+        if (sparsity > 0) {
+            setup_ = PrepareTransform(info.SignalWidth(), info.Dimensions(), sparsity, rank, settings);
+        }
+    }
+
+    FrequencyMap Execute(const Signal& x, int64_t seed = 61) const {
+        if (sparsity_ == 0) {
+            return {};
+        }
+        return DispatchDimensions(info_, [&](const auto& static_info) {
+            return TransformPrepared(x, static_info, setup_, sparsity_, rank_, seed, settings_, &pools_);
+        });
+    }
+
+    const SignalInfo& Info() const {
+        return info_;
+    }
+
+private:
+    const SignalInfo info_;
+    const int64_t sparsity_;
+    const int rank_;
+    const TransformSettings settings_;
+    TransformSetup setup_;
+    mutable SplittingTree::NodePools pools_;
+};
+
+// Transforms of signals of the same shape, result i is the transform of signals[i] with the given seed.
+// Signals are spread over settings.thread_pool and share one SparseFFTPlan.
+std::vector<FrequencyMap> BatchSparseFFT(const std::vector<const Signal*>& signals, const SignalInfo& info, int64_t sparsity, int rank,
+                                         int64_t seed = 61, TransformSettings settings = {}) {
+    SparseFFTPlan plan(info, sparsity, rank, settings);
+    std::vector<FrequencyMap> res(signals.size());
+    ThreadPool::TaskGroup group(settings.thread_pool);
+    for (size_t i = 0; i < signals.size(); ++i) {
+        group.Run([&, i] {
+            res[i] = plan.Execute(*signals[i], seed);
+        });
+    }
+    group.Wait();
+    return res;
+}
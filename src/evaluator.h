@@ -0,0 +1,330 @@
+#pragma once
+
+#include "filter.h"
+#include <algorithm>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DISFFT_X86_KERNELS
+#endif
+
+// Evaluates sum_j value_j * exp(2 * pi * i * <freq_j, t> / n) at a batch of flattened sample times.
+// Frequencies are stored as structure of arrays padded to kLanes entries, so that the vector
+// kernels need no tail handling; padding entries have zero value. Evaluate may be called concurrently.
+class SpectrumEvaluator {
+public:
+    enum class Kernel {
+        kScalar,
+        kAvx2,
+        kAvx512,
+    };
+
+    template <int D>
+    explicit SpectrumEvaluator(const BasicSignalInfo<D>& info, Kernel kernel = BestKernel()) :
+        info_(info), kernel_(kernel), wide_(info.LogSignalWidth() > 32),
+        coords_(wide_ ? 0 : info.Dimensions()), wide_coords_(wide_ ? info.Dimensions() : 0) {
+        assert(info.Dimensions() <= kMaxDimensions);
+        // vector kernels compute phases modulo 2^32
+        if (wide_ || !IsSupported(kernel_)) {
+            kernel_ = Kernel::kScalar;
+        }
+    }
+
+    static bool IsSupported(Kernel kernel) {
+        switch (kernel) {
+            case Kernel::kScalar:
+                return true;
+#ifdef DISFFT_X86_KERNELS
+            case Kernel::kAvx2:
+                return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+            case Kernel::kAvx512:
+                return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+            default:
+                return false;
+        }
+    }
+
+    static Kernel BestKernel() {
+        static const Kernel best = IsSupported(Kernel::kAvx512) ? Kernel::kAvx512 :
+                                   IsSupported(Kernel::kAvx2) ? Kernel::kAvx2 : Kernel::kScalar;
+        return best;
+    }
+
+    Kernel GetKernel() const {
+        return kernel_;
+    }
+
+    void Clear() {
+        size_ = 0;
+        for (auto& coord : coords_) {
+            coord.clear();
+        }
+        for (auto& coord : wide_coords_) {
+            coord.clear();
+        }
+        re_.clear();
+        im_.clear();
+    }
+
+    void Reserve(size_t size) {
+        size = PaddedSize(size);
+        for (auto& coord : coords_) {
+            coord.reserve(size);
+        }
+        for (auto& coord : wide_coords_) {
+            coord.reserve(size);
+        }
+        re_.reserve(size);
+        im_.reserve(size);
+    }
+
+    template <int D>
+    void Add(const BasicKey<D>& freq, complex_t value) {
+        Grow();
+        for (int i = 0; i < info_.Dimensions(); ++i) {
+            SetCoord(i, static_cast<uint64_t>(freq[i]));
+        }
+        re_[size_] = value.real();
+        im_[size_] = value.imag();
+        ++size_;
+    }
+
+    // frequency given in flattened form
+    void Add(int64_t flat, complex_t value) {
+        Grow();
+        for (int i = 0; i < info_.Dimensions(); ++i) {
+            SetCoord(i, static_cast<uint64_t>(flat & (info_.SignalWidth() - 1)));
+            flat >>= info_.LogSignalWidth();
+        }
+        re_[size_] = value.real();
+        im_[size_] = value.imag();
+        ++size_;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+
+    void Evaluate(const int64_t* times, int count, complex_t* out) const {
+        if (wide_) {
+            uint64_t wide_time_coords[kTimeBlock * kMaxDimensions];
+            for (int begin = 0; begin < count; begin += kTimeBlock) {
+                int block = std::min(kTimeBlock, count - begin);
+                EvaluateBlockScalar(wide_coords_, times + begin, block, out + begin, wide_time_coords);
+            }
+            return;
+        }
+        // coordinates of a block of times, flattened keys have at most 64 one-bit fields
+        uint32_t time_coords[kTimeBlock * kMaxDimensions];
+        for (int begin = 0; begin < count; begin += kTimeBlock) {
+            int block = std::min(kTimeBlock, count - begin);
+            switch (kernel_) {
+#ifdef DISFFT_X86_KERNELS
+                case Kernel::kAvx2:
+                    EvaluateBlockAvx2(times + begin, block, out + begin, time_coords);
+                    break;
+                case Kernel::kAvx512:
+                    EvaluateBlockAvx512(times + begin, block, out + begin, time_coords);
+                    break;
+#endif
+                default:
+                    EvaluateBlockScalar(coords_, times + begin, block, out + begin, time_coords);
+            }
+        }
+    }
+
+private:
+    static constexpr int kLanes = 8;
+    static constexpr int kTimeBlock = 4;
+
+    static size_t PaddedSize(size_t size) {
+        return (size + kLanes - 1) / kLanes * kLanes;
+    }
+
+    void Grow() {
+        if (size_ == re_.size()) {
+            size_t padded = PaddedSize(size_ + 1);
+            for (auto& coord : coords_) {
+                coord.resize(padded, 0);
+            }
+            for (auto& coord : wide_coords_) {
+                coord.resize(padded, 0);
+            }
+            re_.resize(padded, 0.);
+            im_.resize(padded, 0.);
+        }
+    }
+
+    void SetCoord(int dim, uint64_t value) {
+        if (wide_) {
+            wide_coords_[dim][size_] = value;
+        } else {
+            coords_[dim][size_] = static_cast<uint32_t>(value);
+        }
+    }
+
+    // stores coordinates of times[b] to time_coords[b * Dimensions() + dim]
+    template <class Coord>
+    void UnpackTimes(const int64_t* times, int count, Coord* time_coords) const {
+        int64_t mask = info_.SignalWidth() - 1;
+        for (int b = 0; b < count; ++b) {
+            int64_t flat = times[b];
+            for (int i = 0; i < info_.Dimensions(); ++i) {
+                time_coords[b * info_.Dimensions() + i] = static_cast<Coord>(flat & mask);
+                flat >>= info_.LogSignalWidth();
+            }
+        }
+    }
+
+    // phases wrap modulo 2^64, a multiple of the signal width
+    template <class Coord>
+    void EvaluateBlockScalar(const std::vector<std::vector<Coord>>& coords, const int64_t* times, int count, complex_t* out,
+                             Coord* time_coords) const {
+        const auto& roots = info_.Roots();
+        UnpackTimes(times, count, time_coords);
+        for (int b = 0; b < count; ++b) {
+            const Coord* time = time_coords + b * info_.Dimensions();
+            double re = 0, im = 0;
+            for (size_t j = 0; j < size_; ++j) {
+                uint64_t phase = 0;
+                for (int i = 0; i < info_.Dimensions(); ++i) {
+                    phase += static_cast<uint64_t>(coords[i][j]) * time[i];
+                }
+                auto kernel = roots[static_cast<int64_t>(phase & (info_.SignalWidth() - 1))];
+                re += kernel.real() * re_[j] - kernel.imag() * im_[j];
+                im += kernel.real() * im_[j] + kernel.imag() * re_[j];
+            }
+            out[b] = {re, im};
+        }
+    }
+
+#ifdef DISFFT_X86_KERNELS
+    // masked gathers with a zero source, the unmasked ones read an undefined register
+    __attribute__((target("avx2,fma")))
+    static __m256d Gather4(const double* base, __m128i index) {
+        return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), base, index, _mm256_castsi256_pd(_mm256_set1_epi64x(-1)), 8);
+    }
+
+    __attribute__((target("avx512f,avx2,fma")))
+    static __m512d Gather8(const double* base, __m256i index) {
+        return _mm512_mask_i32gather_pd(_mm512_setzero_pd(), 0xFF, index, base, 8);
+    }
+
+    __attribute__((target("avx2,fma")))
+    void EvaluateBlockAvx2(const int64_t* times, int count, complex_t* out, uint32_t* time_coords) const {
+        const auto& roots = info_.Roots();
+        const double* low = reinterpret_cast<const double*>(roots.Low());
+        const double* high = reinterpret_cast<const double*>(roots.High());
+        const __m128i mask = _mm_set1_epi32(static_cast<int>(info_.SignalWidth() - 1));
+        const __m128i low_mask = _mm_set1_epi32((1 << roots.LowBits()) - 1);
+        const bool direct = roots.IsDirect();
+        UnpackTimes(times, count, time_coords);
+        __m256d acc_re[kTimeBlock], acc_im[kTimeBlock];
+        for (int b = 0; b < count; ++b) {
+            acc_re[b] = _mm256_setzero_pd();
+            acc_im[b] = _mm256_setzero_pd();
+        }
+        for (size_t j = 0; j < re_.size(); j += 4) {
+            __m256d value_re = _mm256_loadu_pd(re_.data() + j);
+            __m256d value_im = _mm256_loadu_pd(im_.data() + j);
+            for (int b = 0; b < count; ++b) {
+                const uint32_t* time = time_coords + b * info_.Dimensions();
+                __m128i phase = _mm_setzero_si128();
+                for (int i = 0; i < info_.Dimensions(); ++i) {
+                    __m128i coord = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coords_[i].data() + j));
+                    phase = _mm_add_epi32(phase, _mm_mullo_epi32(coord, _mm_set1_epi32(static_cast<int>(time[i]))));
+                }
+                phase = _mm_and_si128(phase, mask);
+                __m256d kernel_re, kernel_im;
+                if (direct) {
+                    __m128i index = _mm_slli_epi32(phase, 1);
+                    kernel_re = Gather4(low, index);
+                    kernel_im = Gather4(low + 1, index);
+                } else {
+                    __m128i low_index = _mm_slli_epi32(_mm_and_si128(phase, low_mask), 1);
+                    __m128i high_index = _mm_slli_epi32(_mm_srli_epi32(phase, roots.LowBits()), 1);
+                    __m256d a_re = Gather4(high, high_index);
+                    __m256d a_im = Gather4(high + 1, high_index);
+                    __m256d b_re = Gather4(low, low_index);
+                    __m256d b_im = Gather4(low + 1, low_index);
+                    kernel_re = _mm256_fmsub_pd(a_re, b_re, _mm256_mul_pd(a_im, b_im));
+                    kernel_im = _mm256_fmadd_pd(a_re, b_im, _mm256_mul_pd(a_im, b_re));
+                }
+                acc_re[b] = _mm256_fmadd_pd(kernel_re, value_re, _mm256_fnmadd_pd(kernel_im, value_im, acc_re[b]));
+                acc_im[b] = _mm256_fmadd_pd(kernel_re, value_im, _mm256_fmadd_pd(kernel_im, value_re, acc_im[b]));
+            }
+        }
+        for (int b = 0; b < count; ++b) {
+            alignas(32) double re[4], im[4];
+            _mm256_store_pd(re, acc_re[b]);
+            _mm256_store_pd(im, acc_im[b]);
+            out[b] = {(re[0] + re[1]) + (re[2] + re[3]), (im[0] + im[1]) + (im[2] + im[3])};
+        }
+    }
+
+    __attribute__((target("avx512f,avx2,fma")))
+    void EvaluateBlockAvx512(const int64_t* times, int count, complex_t* out, uint32_t* time_coords) const {
+        const auto& roots = info_.Roots();
+        const double* low = reinterpret_cast<const double*>(roots.Low());
+        const double* high = reinterpret_cast<const double*>(roots.High());
+        const __m256i mask = _mm256_set1_epi32(static_cast<int>(info_.SignalWidth() - 1));
+        const __m256i low_mask = _mm256_set1_epi32((1 << roots.LowBits()) - 1);
+        const bool direct = roots.IsDirect();
+        UnpackTimes(times, count, time_coords);
+        __m512d acc_re[kTimeBlock], acc_im[kTimeBlock];
+        for (int b = 0; b < count; ++b) {
+            acc_re[b] = _mm512_setzero_pd();
+            acc_im[b] = _mm512_setzero_pd();
+        }
+        for (size_t j = 0; j < re_.size(); j += 8) {
+            __m512d value_re = _mm512_loadu_pd(re_.data() + j);
+            __m512d value_im = _mm512_loadu_pd(im_.data() + j);
+            for (int b = 0; b < count; ++b) {
+                const uint32_t* time = time_coords + b * info_.Dimensions();
+                __m256i phase = _mm256_setzero_si256();
+                for (int i = 0; i < info_.Dimensions(); ++i) {
+                    __m256i coord = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coords_[i].data() + j));
+                    phase = _mm256_add_epi32(phase, _mm256_mullo_epi32(coord, _mm256_set1_epi32(static_cast<int>(time[i]))));
+                }
+                phase = _mm256_and_si256(phase, mask);
+                __m512d kernel_re, kernel_im;
+                if (direct) {
+                    __m256i index = _mm256_slli_epi32(phase, 1);
+                    kernel_re = Gather8(low, index);
+                    kernel_im = Gather8(low + 1, index);
+                } else {
+                    __m256i low_index = _mm256_slli_epi32(_mm256_and_si256(phase, low_mask), 1);
+                    __m256i high_index = _mm256_slli_epi32(_mm256_srli_epi32(phase, roots.LowBits()), 1);
+                    __m512d a_re = Gather8(high, high_index);
+                    __m512d a_im = Gather8(high + 1, high_index);
+                    __m512d b_re = Gather8(low, low_index);
+                    __m512d b_im = Gather8(low + 1, low_index);
+                    kernel_re = _mm512_fmsub_pd(a_re, b_re, _mm512_mul_pd(a_im, b_im));
+                    kernel_im = _mm512_fmadd_pd(a_re, b_im, _mm512_mul_pd(a_im, b_re));
+                }
+                acc_re[b] = _mm512_fmadd_pd(kernel_re, value_re, _mm512_fnmadd_pd(kernel_im, value_im, acc_re[b]));
+                acc_im[b] = _mm512_fmadd_pd(kernel_re, value_im, _mm512_fmadd_pd(kernel_im, value_re, acc_im[b]));
+            }
+        }
+        for (int b = 0; b < count; ++b) {
+            alignas(64) double re[8], im[8];
+            _mm512_store_pd(re, acc_re[b]);
+            _mm512_store_pd(im, acc_im[b]);
+            out[b] = {((re[0] + re[1]) + (re[2] + re[3])) + ((re[4] + re[5]) + (re[6] + re[7])),
+                      ((im[0] + im[1]) + (im[2] + im[3])) + ((im[4] + im[5]) + (im[6] + im[7]))};
+        }
+    }
+#endif
+
+    SignalInfo info_;
+    Kernel kernel_;
+    size_t size_{0};
+    // frequency coordinates, 32-bit ones for the vector kernels and 64-bit ones for signals wider than 2^32
+    bool wide_;
+    std::vector<std::vector<uint32_t>> coords_;
+    std::vector<std::vector<uint64_t>> wide_coords_;
+    std::vector<double> re_;
+    std::vector<double> im_;
+};
@@ -1,18 +1,41 @@
 #pragma once
 
+#include <array>
+#include <type_traits>
 #include <vector>
 #include <unordered_map>
-#include <iterator>
 #include "tree.h"
+#include "frequency_map.h"
 
-class SignalInfo {
+// Number of dimensions known only at runtime. Other values of D fix it at compile time,
+// so that keys keep their coordinates in a std::array and loops over dimensions unroll.
+const int kDynamicDimensions = 0;
+const int kMaxStaticDimensions = 8;
+// flattened times are int64_t, so a signal of width at least 2 has fewer dimensions
+const int kMaxDimensions = 64;
+
+template <int D>
+class BasicSignalInfo {
 public:
-    SignalInfo(int dimensions, int64_t signal_width):
-        dimensions_(dimensions), signal_width_(signal_width), signal_size_(CalcSignalSize(dimensions, signal_width)), log_signal_width_(CalcLog(signal_width)) {
+    BasicSignalInfo(int dimensions, int64_t signal_width):
+        dimensions_(dimensions), signal_width_(signal_width), signal_size_(CalcSignalSize(dimensions, signal_width)), log_signal_width_(CalcLog(signal_width)),
+        high_bits_(CalcHighBits(dimensions, log_signal_width_)), roots_(&GetRootsOfUnity(signal_width)) {
+        assert(D == kDynamicDimensions || D == dimensions);
+    }
+
+    template <int E>
+    explicit BasicSignalInfo(const BasicSignalInfo<E>& other) :
+        dimensions_(other.dimensions_), signal_width_(other.signal_width_), signal_size_(other.signal_size_),
+        log_signal_width_(other.log_signal_width_), high_bits_(other.high_bits_), roots_(other.roots_) {
+        assert(D == kDynamicDimensions || D == dimensions_);
     }
 
     int Dimensions() const {
-        return dimensions_;
+        if constexpr (D == kDynamicDimensions) {
+            return dimensions_;
+        } else {
+            return D;
+        }
     }
 
     int64_t SignalWidth() const {
@@ -27,11 +50,33 @@ public:
         return signal_size_;
     }
 
-    bool operator==(const SignalInfo& other) const {
+    // roots of unity of degree SignalWidth()
+    const RootsOfUnity& Roots() const {
+        return *roots_;
+    }
+
+    // Fieldwise arithmetic modulo SignalWidth() on flattened keys. The top bit of every field
+    // is handled separately, so that carries and borrows never cross into the next field.
+    int64_t FlatDifference(int64_t a, int64_t b) const {
+        return (((a | high_bits_) - (b & ~high_bits_)) ^ ((a ^ ~b) & high_bits_)) & (signal_size_ - 1);
+    }
+
+    int64_t FlatSum(int64_t a, int64_t b) const {
+        return ((a & ~high_bits_) + (b & ~high_bits_)) ^ ((a ^ b) & high_bits_);
+    }
+
+    int64_t FlatNegate(int64_t a) const {
+        return FlatDifference(0, a);
+    }
+
+    bool operator==(const BasicSignalInfo& other) const {
         return dimensions_ == other.dimensions_ && signal_width_ == other.signal_width_;
     }
 
 private:
+    template <int E>
+    friend class BasicSignalInfo;
+
     static int64_t CalcSignalSize(int dimensions, int64_t signal_width) {
         int64_t res = 1;
         for (int i = 0; i < dimensions; ++i) {
@@ -40,34 +85,47 @@ private:
         return res;
     }
 
+    static int64_t CalcHighBits(int dimensions, int64_t log_signal_width) {
+        int64_t res = 0;
+        for (int i = 0; log_signal_width > 0 && i < dimensions; ++i) {
+            res |= int64_t(1) << ((i + 1) * log_signal_width - 1);
+        }
+        return res;
+    }
+
     int dimensions_;
     int64_t signal_width_;
     int64_t signal_size_;
     int64_t log_signal_width_;
+    int64_t high_bits_;
+    const RootsOfUnity* roots_;
 };
 
 
-class Key {
+template <int D>
+class BasicKey {
 public:
-    explicit Key(const SignalInfo& info) : info_(info), indices_(info.Dimensions(), 0) {
+    using Info = BasicSignalInfo<D>;
+
+    explicit BasicKey(const Info& info) : info_(info), indices_(MakeIndices(info)) {
     }
 
-    explicit Key(const SignalInfo& info, std::vector<int64_t> key) : info_(info), indices_(std::move(key)) {
-        assert(info.Dimensions() == static_cast<int>(indices_.size()));
+    explicit BasicKey(const Info& info, const std::vector<int64_t>& key) : info_(info), indices_(MakeIndices(info)) {
+        assert(info.Dimensions() == static_cast<int>(key.size()));
+        std::copy(key.begin(), key.end(), indices_.begin());
     }
 
-    explicit Key(const SignalInfo& info, const std::initializer_list<int64_t>& key) : info_(info), indices_(info.Dimensions(), 0) {
-        assert(info.Dimensions() == static_cast<int>(indices_.size()));
+    explicit BasicKey(const Info& info, const std::initializer_list<int64_t>& key) : info_(info), indices_(MakeIndices(info)) {
+        assert(info.Dimensions() == static_cast<int>(key.size()));
         std::copy(key.begin(), key.end(), indices_.begin());
     }
 
-    explicit Key(const SignalInfo& info, int64_t flatten) : info_(info), indices_(info.Dimensions(), 0) {
-        assert(info.Dimensions() == static_cast<int>(indices_.size()));
+    explicit BasicKey(const Info& info, int64_t flatten) : info_(info), indices_(MakeIndices(info)) {
         SetFromFlatten(flatten);
     }
 
     void SetZero() {
-        indices_.assign(indices_.size(), 0);
+        std::fill(indices_.begin(), indices_.end(), 0);
     }
 
     // leftmost dimension is highest in the tree
@@ -88,38 +146,42 @@ public:
         return res;
     }
 
-    bool operator==(const Key& other) const {
+    bool operator==(const BasicKey& other) const {
         assert(info_ == other.info_);
         return indices_ == other.indices_;
     }
 
-    SignalInfo GetSignalInfo() const {
+    Info GetSignalInfo() const {
         return info_;
     }
 
-    Key IncreaseAt(int index, int64_t value) const {
-        std::vector<int64_t> new_indices(indices_);
-        new_indices[index] += value + info_.SignalWidth();
-        new_indices[index] %= info_.SignalWidth();
-        return Key{info_, std::move(new_indices)};
+    BasicKey IncreaseAt(int index, int64_t value) const {
+        BasicKey res(*this);
+        res.indices_[index] = (res.indices_[index] + value) & (info_.SignalWidth() - 1);
+        return res;
     }
 
-    void StoreDifference(const Key& a, const Key& b) {
+    void StoreDifference(const BasicKey& a, const BasicKey& b) {
         int64_t mod = info_.SignalWidth() - 1;
         for (int i = 0; i < info_.Dimensions(); ++i) {
             indices_[i] = (a.indices_[i] - b.indices_[i] + info_.SignalWidth()) & mod;
         }
     }
 
-    Key operator-() const {
-        std::vector<int64_t> new_indices(info_.Dimensions());
+    // b is given in flattened form
+    void StoreDifference(const BasicKey& a, int64_t b) {
+        SetFromFlatten(info_.FlatDifference(a.Flatten(), b));
+    }
+
+    BasicKey operator-() const {
+        BasicKey res(info_);
         for (int i = 0; i < info_.Dimensions(); ++i) {
-            new_indices[i] = (-indices_[i] + info_.SignalWidth()) % info_.SignalWidth();
+            res.indices_[i] = (-indices_[i] + info_.SignalWidth()) % info_.SignalWidth();
         }
-        return Key{info_, std::move(new_indices)};
+        return res;
     }
 
-    int64_t operator*(const Key& key) const {
+    int64_t operator*(const BasicKey& key) const {
         int64_t result = 0;
         for (int i = 0; i < info_.Dimensions(); ++i) {
             result += key[i] * indices_[i];
@@ -136,15 +198,25 @@ public:
     }
 
 private:
-    SignalInfo info_;
-    std::vector<int64_t> indices_;
+    using Indices = std::conditional_t<D == kDynamicDimensions, std::vector<int64_t>, std::array<int64_t, D>>;
+
+    static Indices MakeIndices(const Info& info) {
+        if constexpr (D == kDynamicDimensions) {
+            return Indices(info.Dimensions(), 0);
+        } else {
+            return Indices{};
+        }
+    }
+
+    Info info_;
+    Indices indices_;
 };
 
 namespace std {
-    template<>
-    struct hash<Key> {
+    template<int D>
+    struct hash<BasicKey<D>> {
     public:
-        std::size_t operator()(const Key& key) const {
+        std::size_t operator()(const BasicKey<D>& key) const {
             return hasher_(key.Flatten());
         }
 
@@ -153,65 +225,106 @@ namespace std {
     };
 }
 
-using FrequencyMap = std::unordered_map<Key, complex_t>;
+using SignalInfo = BasicSignalInfo<kDynamicDimensions>;
+using Key = BasicKey<kDynamicDimensions>;
 using NodePtr = SplittingTree::NodePtr;
 using Node = SplittingTree::Node;
 
 FrequencyMap MapUnion(const FrequencyMap& a, const FrequencyMap& b) {
-    FrequencyMap c;
-    for (const auto& w : a) {
-        c[w.first] += w.second;
-    }
-    for (const auto& w : b) {
-        c[w.first] += w.second;
-    }
+    FrequencyMap c(a);
+    c.Merge(b);
     return c;
 }
 
 class Filter {
 public:
 
-    Filter(const SplittingTree& tree, const NodePtr& node, const SignalInfo& info) : label_(info, node->label), info_(info), period_size_(CalcLog(info.SignalWidth())) {
+    template <int D>
+    Filter(const SplittingTree& tree, const NodePtr& node, const BasicSignalInfo<D>& info) : label_(node->label), info_(info), period_size_(CalcLog(info.SignalWidth())) {
         path_ = tree.GetRootPath(node);
-        std::unordered_map<Key, complex_t> filter;
-        filter[Key(info, 0)] = 1;
+        // the filter is a convolution of (delta(0) + phase * delta(-shift)) / 2 over the path,
+        // its taps are all subset sums of the shifts, which are distinct
+        size_t taps = size_t(1) << path_.size();
+        offsets_.reserve(taps);
+        re_.reserve(taps);
+        im_.reserve(taps);
+        offsets_.push_back(0);
+        re_.push_back(1.);
+        im_.push_back(0.);
         for (int i = 0; i < static_cast<int>(path_.size()); ++i) {
-            std::unordered_map<Key, complex_t> updated_filter;
-            int current_period = CalcCurrentPeriod(i);
-            int64_t subtree_level = CalcSubtreeLevel(i);
-            int64_t shift = info.SignalWidth() >> subtree_level;
-            assert(current_period >= 0 && current_period < info.Dimensions());
-            auto phase = CalcKernel(-label_[current_period], 1 << subtree_level);
-            phase_.push_back(phase);
-            for (auto it : filter) {
-                Key index = it.first;
-                updated_filter[index] = (MapFilterValueAtTime(filter, index) + phase * MapFilterValueAtTime(filter, index.IncreaseAt(current_period, shift))) / 2.;
-                updated_filter[index.IncreaseAt(current_period, -shift)] = (MapFilterValueAtTime(filter, index.IncreaseAt(current_period, -shift)) + phase * MapFilterValueAtTime(filter, index)) / 2.;
-            }
-            filter.swap(updated_filter);
-            updated_filter.clear();
+            AddLevel(i);
         }
-        filter_.reserve(filter.size());
-        filter_.insert(filter_.end(), std::make_move_iterator(filter.begin()), std::make_move_iterator(filter.end()));
     }
 
-    const std::vector<std::pair<Key, complex_t>>& FilterTime() const {
-        return filter_;
+    // filter with an empty path, passes the whole spectrum
+    template <int D>
+    Filter(const BasicSignalInfo<D>& info, int64_t label) : label_(label), info_(info), period_size_(CalcLog(info.SignalWidth())),
+        offsets_(1, 0), re_(1, 1.), im_(1, 0.) {
+    }
+
+    // filter of a child of the node the parent filter was built for, with one more level in the path;
+    // phases of the parent levels depend only on the label bits the child shares with the parent
+    Filter(const Filter& parent, int level, int64_t label) : label_(label), info_(parent.info_),
+        period_size_(parent.period_size_), path_(parent.path_), phase_(parent.phase_) {
+        path_.push_back(level);
+        size_t taps = 2 * parent.offsets_.size();
+        offsets_.reserve(taps);
+        re_.reserve(taps);
+        im_.reserve(taps);
+        offsets_.assign(parent.offsets_.begin(), parent.offsets_.end());
+        re_.assign(parent.re_.begin(), parent.re_.end());
+        im_.assign(parent.im_.begin(), parent.im_.end());
+        AddLevel(static_cast<int>(path_.size()) - 1);
     }
 
-    complex_t FilterFrequency(const Key& key) const {
+    // taps are stored as flattened time offsets and separate real and imaginary parts of the values
+    size_t TapCount() const {
+        return offsets_.size();
+    }
+
+    const std::vector<int64_t>& TapOffsets() const {
+        return offsets_;
+    }
+
+    const std::vector<double>& TapReal() const {
+        return re_;
+    }
+
+    const std::vector<double>& TapImag() const {
+        return im_;
+    }
+
+    const std::vector<int>& Path() const {
+        return path_;
+    }
+
+    template <int D>
+    complex_t FilterFrequency(const BasicKey<D>& key) const {
+        complex_t freq = 1.;
+        for (size_t i = 0; i < path_.size(); ++i) {
+            int current_period = CalcCurrentPeriod(i);
+            freq *= (1. + phase_[i] * info_.Roots()[key[current_period] * (info_.SignalWidth() >> CalcSubtreeLevel(i))]) / 2.;
+        }
+        return freq;
+    }
+
+    // frequency given in flattened form
+    complex_t FilterFrequency(int64_t flat) const {
         complex_t freq = 1.;
         for (size_t i = 0; i < path_.size(); ++i) {
             int current_period = CalcCurrentPeriod(i);
-            freq *= (1. + phase_[i] * CalcKernel(key[current_period], 1 << CalcSubtreeLevel(i))) / 2.;
+            int64_t coord = (flat >> (current_period * info_.LogSignalWidth())) & (info_.SignalWidth() - 1);
+            freq *= (1. + phase_[i] * info_.Roots()[coord * (info_.SignalWidth() >> CalcSubtreeLevel(i))]) / 2.;
         }
         return freq;
     }
 
-    complex_t FilterValueAtTime(const Key& time) const {
-        for (const auto& freq : filter_) {
-            if (freq.first == time) {
-                return freq.second;
+    template <int D>
+    complex_t FilterValueAtTime(const BasicKey<D>& time) const {
+        int64_t flat = time.Flatten();
+        for (size_t j = 0; j < offsets_.size(); ++j) {
+            if (offsets_[j] == flat) {
+                return {re_[j], im_[j]};
             }
         }
         return 0.;
@@ -219,6 +332,27 @@ public:
 
 
 private:
+    void AddLevel(int path_pos) {
+        int current_period = CalcCurrentPeriod(path_pos);
+        int64_t subtree_level = CalcSubtreeLevel(path_pos);
+        int64_t shift = info_.SignalWidth() >> subtree_level;
+        int64_t shift_at = shift << (current_period * info_.LogSignalWidth());
+        assert(current_period >= 0 && current_period < info_.Dimensions());
+        int64_t label = (label_ >> (current_period * info_.LogSignalWidth())) & (info_.SignalWidth() - 1);
+        auto phase = info_.Roots()[-label * shift];
+        phase_.push_back(phase);
+        size_t size = offsets_.size();
+        for (size_t j = 0; j < size; ++j) {
+            complex_t value = complex_t(re_[j], im_[j]) / 2.;
+            complex_t shifted = phase * value;
+            offsets_.push_back(info_.FlatDifference(offsets_[j], shift_at));
+            re_.push_back(shifted.real());
+            im_.push_back(shifted.imag());
+            re_[j] = value.real();
+            im_[j] = value.imag();
+        }
+    }
+
     int CalcSubtreeLevel(int path_pos) const {
         return path_[path_pos] - CalcCurrentPeriod(path_pos) * period_size_ + 1;
     }
@@ -227,23 +361,50 @@ private:
         return path_[path_pos] / period_size_;
     }
 
-    complex_t MapFilterValueAtTime(const std::unordered_map<Key, complex_t>& filter, const Key& time) const {
-        auto it = filter.find(time);
-        if (it != filter.end()) {
-            return it->second;
-        }
-        return 0.;
-    }
-
 // TODO: Calc frequencies faster
 //    complex_t CalcFrequencyFactor(double g) const {
 //        return {(1 + cos(g)) / 2, sin(g) / 2};
 //    }
 
-    Key label_;
+    int64_t label_;
     SignalInfo info_;
     int period_size_;
     std::vector<int> path_;
     std::vector<complex_t> phase_;
-    std::vector<std::pair<Key, complex_t>> filter_;
-};
\ No newline at end of file
+    std::vector<int64_t> offsets_;
+    std::vector<double> re_;
+    std::vector<double> im_;
+};
+
+template <int D>
+std::shared_ptr<const Filter> GetNodeFilter(const SplittingTree& tree, const NodePtr& node, const BasicSignalInfo<D>& info);
+
+// Filter of the node as a leaf, memoized in the node. It is derived from the filter of the parent,
+// which is the same filter when the parent has a single child.
+template <int D>
+std::shared_ptr<const Filter> GetLeafFilter(const SplittingTree& tree, Node* node, const BasicSignalInfo<D>& info) {
+    if (node->filter) {
+        return node->filter;
+    }
+    if (Node* parent = node->Parent()) {
+        auto parent_filter = GetLeafFilter(tree, parent, info);
+        if (parent->HasBothChild()) {
+            node->filter = std::make_shared<Filter>(*parent_filter, parent->level, node->label);
+        } else {
+            node->filter = std::move(parent_filter);
+        }
+    } else if (tree.GetParentTree()) {
+        node->filter = GetNodeFilter(*tree.GetParentTree(), tree.GetParentNode(), info);
+    } else {
+        node->filter = std::make_shared<Filter>(info, node->label);
+    }
+    return node->filter;
+}
+
+template <int D>
+std::shared_ptr<const Filter> GetNodeFilter(const SplittingTree& tree, const NodePtr& node, const BasicSignalInfo<D>& info) {
+    if (node->HasBothChild()) {
+        return std::make_shared<Filter>(tree, node, info);
+    }
+    return GetLeafFilter(tree, node.get(), info);
+}
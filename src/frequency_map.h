@@ -0,0 +1,196 @@
+#pragma once
+
+#include "arithmetics.h"
+#include <algorithm>
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+template <int D>
+class BasicKey;
+
+// Map from flattened frequencies to values with open addressing. Entries are stored densely
+// in insertion order, the index keeps positions of the entries together with their hashes
+// and is probed linearly, so lookups touch no entries but the matching one.
+class FrequencyMap {
+public:
+    using value_type = std::pair<int64_t, complex_t>;
+    using iterator = std::vector<value_type>::iterator;
+    using const_iterator = std::vector<value_type>::const_iterator;
+
+    FrequencyMap() = default;
+
+    FrequencyMap(std::initializer_list<value_type> values) {
+        reserve(values.size());
+        for (const auto& value : values) {
+            emplace(value.first, value.second);
+        }
+    }
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+    bool empty() const {
+        return entries_.empty();
+    }
+
+    iterator begin() {
+        return entries_.begin();
+    }
+
+    iterator end() {
+        return entries_.end();
+    }
+
+    const_iterator begin() const {
+        return entries_.begin();
+    }
+
+    const_iterator end() const {
+        return entries_.end();
+    }
+
+    void clear() {
+        entries_.clear();
+        std::fill(slots_.begin(), slots_.end(), Slot{});
+    }
+
+    void reserve(size_t size) {
+        entries_.reserve(size);
+        if (2 * size > slots_.size()) {
+            Rehash(2 * size);
+        }
+    }
+
+    // inserts the value unless the key is present, like std::unordered_map::emplace
+    std::pair<iterator, bool> emplace(int64_t key, complex_t value) {
+        uint32_t hash = Hash(key);
+        size_t slot = FindSlot(key, hash);
+        if (slots_.empty() || slots_[slot].index == kEmpty) {
+            if (2 * (entries_.size() + 1) > slots_.size()) {
+                Rehash(2 * (entries_.size() + 1));
+                slot = FindSlot(key, hash);
+            }
+            slots_[slot] = {hash, static_cast<uint32_t>(entries_.size())};
+            entries_.emplace_back(key, value);
+            return {entries_.end() - 1, true};
+        }
+        return {entries_.begin() + slots_[slot].index, false};
+    }
+
+    complex_t& operator[](int64_t key) {
+        return emplace(key, 0.).first->second;
+    }
+
+    template <int D>
+    complex_t& operator[](const BasicKey<D>& key) {
+        return (*this)[key.Flatten()];
+    }
+
+    iterator find(int64_t key) {
+        auto index = FindIndex(key);
+        return index == kEmpty ? entries_.end() : entries_.begin() + index;
+    }
+
+    const_iterator find(int64_t key) const {
+        auto index = FindIndex(key);
+        return index == kEmpty ? entries_.end() : entries_.begin() + index;
+    }
+
+    template <int D>
+    iterator find(const BasicKey<D>& key) {
+        return find(key.Flatten());
+    }
+
+    template <int D>
+    const_iterator find(const BasicKey<D>& key) const {
+        return find(key.Flatten());
+    }
+
+    size_t count(int64_t key) const {
+        return FindIndex(key) == kEmpty ? 0 : 1;
+    }
+
+    // adds the values of other, takes over its storage if this map is empty
+    void Merge(FrequencyMap&& other) {
+        if (entries_.empty()) {
+            *this = std::move(other);
+            return;
+        }
+        Merge(other);
+    }
+
+    void Merge(const FrequencyMap& other) {
+        reserve(entries_.size() + other.size());
+        for (const auto& value : other.entries_) {
+            (*this)[value.first] += value.second;
+        }
+    }
+
+    // entries ordered by flattened frequency
+    std::vector<value_type> Sorted() const {
+        std::vector<value_type> res(entries_);
+        std::sort(res.begin(), res.end(), [](const value_type& a, const value_type& b) {
+            return a.first < b.first;
+        });
+        return res;
+    }
+
+private:
+    static constexpr uint32_t kEmpty = UINT32_MAX;
+
+    struct Slot {
+        uint32_t hash{0};
+        uint32_t index{kEmpty};
+    };
+
+    // Fibonacci hashing, the high bits of the product depend on all bits of the key
+    static uint32_t Hash(int64_t key) {
+        return static_cast<uint32_t>((static_cast<uint64_t>(key) * 0x9E3779B97F4A7C15ull) >> 32);
+    }
+
+    // slot holding the key, or the empty slot where it belongs
+    size_t FindSlot(int64_t key, uint32_t hash) const {
+        if (slots_.empty()) {
+            return 0;
+        }
+        size_t mask = slots_.size() - 1;
+        for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+            const auto& current = slots_[slot];
+            if (current.index == kEmpty || (current.hash == hash && entries_[current.index].first == key)) {
+                return slot;
+            }
+        }
+    }
+
+    uint32_t FindIndex(int64_t key) const {
+        if (slots_.empty()) {
+            return kEmpty;
+        }
+        return slots_[FindSlot(key, Hash(key))].index;
+    }
+
+    void Rehash(size_t size) {
+        size_t buckets = 16;
+        while (buckets < size) {
+            buckets *= 2;
+        }
+        std::vector<Slot> slots(buckets);
+        size_t mask = buckets - 1;
+        for (const auto& slot : slots_) {
+            if (slot.index != kEmpty) {
+                size_t pos = slot.hash & mask;
+                while (slots[pos].index != kEmpty) {
+                    pos = (pos + 1) & mask;
+                }
+                slots[pos] = slot;
+            }
+        }
+        slots_ = std::move(slots);
+    }
+
+    std::vector<value_type> entries_;
+    std::vector<Slot> slots_;
+};
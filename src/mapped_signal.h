@@ -0,0 +1,224 @@
+#pragma once
+
+#include "disfft.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+enum class SampleFormat {
+    Complex128,  // interleaved doubles
+    Complex64,   // interleaved floats
+};
+
+// Sample times requested together, sorted by position in the flattened signal and deduplicated.
+// The mapped signal reads the distinct times in one sweep and scatters the values back.
+class SampleSchedule {
+public:
+    void Assign(const int64_t* indices, size_t count) {
+        sorted_.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            sorted_[i] = {indices[i], static_cast<uint32_t>(i)};
+        }
+        std::sort(sorted_.begin(), sorted_.end());
+        unique_.clear();
+        slots_.resize(count);
+        for (const auto& request : sorted_) {
+            if (unique_.empty() || unique_.back() != request.first) {
+                unique_.push_back(request.first);
+            }
+            slots_[request.second] = static_cast<uint32_t>(unique_.size() - 1);
+        }
+    }
+
+    // distinct times in increasing order
+    const std::vector<int64_t>& Indices() const {
+        return unique_;
+    }
+
+    // values of the distinct times to the values of the requests
+    void Scatter(const complex_t* values, complex_t* out) const {
+        for (size_t i = 0; i < slots_.size(); ++i) {
+            out[i] = values[slots_[i]];
+        }
+    }
+
+private:
+    std::vector<std::pair<int64_t, uint32_t>> sorted_;
+    std::vector<int64_t> unique_;
+    std::vector<uint32_t> slots_;
+};
+
+// Signal read from a raw file of interleaved complex samples in the Key::Flatten order. The file is
+// mapped read-only and pages are loaded on first access only, so a transform touching a sublinear
+// number of samples reads a sublinear part of the file. Pages touched by the samples are counted.
+// Batched requests are sorted by position and their pages prefetched, see ValuesAtIndices.
+class MappedFileSignal: public Signal {
+public:
+    MappedFileSignal(const SignalInfo& info, const std::string& path, SampleFormat format = SampleFormat::Complex128):
+            info_(info),
+            format_(format),
+            sample_bytes_(format == SampleFormat::Complex128 ? 2 * sizeof(double) : 2 * sizeof(float)),
+            size_(static_cast<size_t>(info.SignalSize()) * sample_bytes_) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), "cannot open " + path);
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < size_) {
+            int error = errno;
+            close(fd);
+            throw std::system_error(error ? error : EINVAL, std::generic_category(), "file is too short: " + path);
+        }
+        void* data = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+        int error = errno;
+        close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error(error, std::generic_category(), "cannot map " + path);
+        }
+        data_ = static_cast<const char*>(data);
+        // samples are drawn at random times, readahead would only load pages nobody reads
+        madvise(data, size_, MADV_RANDOM);
+
+        page_shift_ = __builtin_ctzl(static_cast<unsigned long>(sysconf(_SC_PAGESIZE)));
+        size_t pages = ((size_ - 1) >> page_shift_) + 1;
+        touched_words_ = (pages + 63) / 64;
+        touched_ = std::make_unique<std::atomic<uint64_t>[]>(touched_words_);
+        for (size_t i = 0; i < touched_words_; ++i) {
+            touched_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+    MappedFileSignal(const MappedFileSignal&) = delete;
+    MappedFileSignal& operator=(const MappedFileSignal&) = delete;
+
+    ~MappedFileSignal() override {
+        munmap(const_cast<char*>(data_), size_);
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        return Load(key.Flatten());
+    }
+
+    complex_t ValueAtIndex(const SignalInfo&, int64_t index) const override {
+        return Load(index);
+    }
+
+    // Large requests are served in order of position: pages not read yet are asked from the kernel
+    // in runs first, then the samples are read in one sweep.
+    void ValuesAtIndices(const SignalInfo&, const int64_t* indices, size_t count, complex_t* out) const override {
+        if (count < kScheduleMinRequest) {
+            for (size_t i = 0; i < count; ++i) {
+                out[i] = Load(indices[i]);
+            }
+            return;
+        }
+        static thread_local SampleSchedule schedule;
+        static thread_local std::vector<complex_t> values;
+        schedule.Assign(indices, count);
+        const auto& sorted = schedule.Indices();
+        Prefetch(sorted);
+        values.resize(sorted.size());
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            values[i] = Load(sorted[i]);
+        }
+        schedule.Scatter(values.data(), out);
+    }
+
+    double ZeroThreshold() const override {
+        return format_ == SampleFormat::Complex128 ? RealTraits<double>::kEps : RealTraits<float>::kEps;
+    }
+
+    // number of distinct pages of the file the samples were read from
+    int64_t PagesTouched() const {
+        int64_t pages = 0;
+        for (size_t i = 0; i < touched_words_; ++i) {
+            pages += __builtin_popcountll(touched_[i].load(std::memory_order_relaxed));
+        }
+        return pages;
+    }
+
+    int64_t PagesTotal() const {
+        return static_cast<int64_t>(((size_ - 1) >> page_shift_) + 1);
+    }
+
+    void ResetPagesTouched() {
+        for (size_t i = 0; i < touched_words_; ++i) {
+            touched_[i].store(0, std::memory_order_relaxed);
+        }
+    }
+
+private:
+    static constexpr size_t kScheduleMinRequest = 16;
+    // pages between two requested ones are read too when the gap is this short
+    static constexpr size_t kPrefetchGapPages = 8;
+
+    // starts reading the runs of pages of the sorted times which were not touched yet
+    void Prefetch(const std::vector<int64_t>& sorted) const {
+        size_t first = 0;
+        size_t last = 0;
+        bool open = false;
+        for (auto index : sorted) {
+            size_t page = (static_cast<size_t>(index) * sample_bytes_) >> page_shift_;
+            if (IsTouched(page)) {
+                continue;
+            }
+            if (open && page <= last + kPrefetchGapPages) {
+                last = page;
+                continue;
+            }
+            if (open) {
+                WillNeed(first, last);
+            }
+            first = last = page;
+            open = true;
+        }
+        if (open) {
+            WillNeed(first, last);
+        }
+    }
+
+    void WillNeed(size_t first, size_t last) const {
+        size_t begin = first << page_shift_;
+        size_t end = std::min(size_, (last + 1) << page_shift_);
+        madvise(const_cast<char*>(data_) + begin, end - begin, MADV_WILLNEED);
+    }
+
+    bool IsTouched(size_t page) const {
+        return touched_[page / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (page % 64));
+    }
+
+    complex_t Load(int64_t index) const {
+        size_t offset = static_cast<size_t>(index) * sample_bytes_;
+        Touch(offset >> page_shift_);
+        if (format_ == SampleFormat::Complex128) {
+            const auto* value = reinterpret_cast<const double*>(data_ + offset);
+            return {value[0], value[1]};
+        }
+        const auto* value = reinterpret_cast<const float*>(data_ + offset);
+        return {value[0], value[1]};
+    }
+
+    void Touch(size_t page) const {
+        // the read keeps the cache line shared once the page is marked
+        if (!IsTouched(page)) {
+            touched_[page / 64].fetch_or(uint64_t(1) << (page % 64), std::memory_order_relaxed);
+        }
+    }
+
+    const SignalInfo info_;
+    const SampleFormat format_;
+    const size_t sample_bytes_;
+    const size_t size_;
+    const char* data_{nullptr};
+    int page_shift_{0};
+    size_t touched_words_{0};
+    std::unique_ptr<std::atomic<uint64_t>[]> touched_;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "disfft.h"
+#include <vector>
+
+// Window of a ring buffer of time steps, the time axis is the last (most significant) dimension.
+// Time step t of the window is slot (head + t) mod width of the buffer.
+class RingBufferSignal: public Signal {
+public:
+    RingBufferSignal(const SignalInfo& info, const complex_t* buffer, int64_t head):
+            width_(info.SignalWidth()),
+            shift_((info.Dimensions() - 1) * info.LogSignalWidth()),
+            buffer_(buffer),
+            head_(head) {
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        return buffer_[Slot(key.Flatten())];
+    }
+
+    complex_t ValueAtIndex(const SignalInfo&, int64_t index) const override {
+        return buffer_[Slot(index)];
+    }
+
+    void ValuesAtIndices(const SignalInfo&, const int64_t* indices, size_t count, complex_t* out) const override {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = buffer_[Slot(indices[i])];
+        }
+    }
+
+private:
+    int64_t Slot(int64_t index) const {
+        int64_t time = ((index >> shift_) + head_) & (width_ - 1);
+        return (time << shift_) | (index & ((int64_t(1) << shift_) - 1));
+    }
+
+    const int64_t width_;
+    const int shift_;
+    const complex_t* buffer_;
+    const int64_t head_;
+};
+
+// Sparse spectra of a sliding window over the last SignalWidth() time steps of a stream, one every hop steps.
+// A time step holds SignalSize() / SignalWidth() values, one for 1D signals. Between two spectra the previous
+// one is moved by the shift theorem and used as a warm start, so only the frequencies that changed are searched
+// for, at most change_sparsity of them.
+class StreamingSparseFFT {
+public:
+    StreamingSparseFFT(const SignalInfo& info, int64_t sparsity, int64_t change_sparsity, int rank, int64_t hop,
+                       int64_t seed = 61, TransformSettings settings = {}):
+            info_(info),
+            sparsity_(sparsity),
+            change_sparsity_(change_sparsity),
+            rank_(rank),
+            hop_(hop),
+            seed_(seed),
+            settings_(settings),
+            step_size_(info.SignalSize() / info.SignalWidth()),
+            buffer_(info.SignalSize()) {
+    }
+
+    // appends a time step of StepSize() values, returns whether a new spectrum is ready
+    bool Push(const complex_t* step) {
+        int64_t slot = pushed_ & (info_.SignalWidth() - 1);
+        std::copy(step, step + step_size_, buffer_.begin() + slot * step_size_);
+        ++pushed_;
+        ++since_spectrum_;
+        if (pushed_ < info_.SignalWidth() || (has_spectrum_ && since_spectrum_ < hop_)) {
+            return false;
+        }
+        RingBufferSignal x(info_, buffer_.data(), pushed_ & (info_.SignalWidth() - 1));
+        int64_t seed = seed_ + pushed_;
+        if (has_spectrum_) {
+            spectrum_ = WarmStartSparseFFT(x, info_, Shifted(spectrum_, since_spectrum_), change_sparsity_, rank_, seed, settings_);
+        } else {
+            spectrum_ = RecursiveSparseFFT(x, info_, sparsity_, rank_, seed, settings_);
+            has_spectrum_ = true;
+        }
+        since_spectrum_ = 0;
+        return true;
+    }
+
+    // spectrum of the window ending at the last time step the spectrum was computed at
+    const FrequencyMap& Spectrum() const {
+        return spectrum_;
+    }
+
+    int64_t StepSize() const {
+        return step_size_;
+    }
+
+    // time steps pushed so far
+    int64_t Pushed() const {
+        return pushed_;
+    }
+
+private:
+    // spectrum of the window moved forward by steps time steps, exact for frequencies on the grid
+    FrequencyMap Shifted(const FrequencyMap& spectrum, int64_t steps) const {
+        FrequencyMap res;
+        res.reserve(spectrum.size());
+        int shift = (info_.Dimensions() - 1) * info_.LogSignalWidth();
+        auto width = static_cast<double>(info_.SignalWidth());
+        for (const auto& freq : spectrum) {
+            int64_t time_freq = freq.first >> shift;
+            auto phase = static_cast<double>((time_freq * steps) & (info_.SignalWidth() - 1));
+            res.emplace(freq.first, freq.second * CalcKernel(phase, width));
+        }
+        return res;
+    }
+
+    const SignalInfo info_;
+    const int64_t sparsity_;
+    const int64_t change_sparsity_;
+    const int rank_;
+    const int64_t hop_;
+    const int64_t seed_;
+    const TransformSettings settings_;
+    const int64_t step_size_;
+    std::vector<complex_t> buffer_;
+    int64_t pushed_{0};
+    int64_t since_spectrum_{0};
+    bool has_spectrum_{false};
+    FrequencyMap spectrum_;
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "disfft.h"
+#include <vector>
+
+// View of samples laid out with a stride per dimension, e.g. one channel of an interleaved
+// multi-channel buffer, a sub-volume of a larger array or a transposed array. Strides, offset and
+// channel stride count samples, the sample at key k is data[offset + channel * channel_stride + sum k[i] * strides[i]].
+template <class Real>
+class BasicStridedSignal: public Signal {
+public:
+    BasicStridedSignal(const SignalInfo& info, const std::complex<Real>* data, std::vector<int64_t> strides, int64_t offset = 0,
+                       int64_t channel = 0, int64_t channel_stride = 0):
+            log_width_(info.LogSignalWidth()),
+            mask_(info.SignalWidth() - 1),
+            data_(data + offset + channel * channel_stride),
+            strides_(std::move(strides)) {
+        assert(static_cast<int>(strides_.size()) == info.Dimensions());
+    }
+
+    // strides of a dense array in the Key::Flatten order with channels interleaved samples
+    static std::vector<int64_t> DenseStrides(const SignalInfo& info, int64_t channels = 1) {
+        std::vector<int64_t> strides(info.Dimensions());
+        int64_t stride = channels;
+        for (auto& value : strides) {
+            value = stride;
+            stride *= info.SignalWidth();
+        }
+        return strides;
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        return Load(key.Flatten());
+    }
+
+    complex_t ValueAtIndex(const SignalInfo&, int64_t index) const override {
+        return Load(index);
+    }
+
+    void ValuesAtIndices(const SignalInfo&, const int64_t* indices, size_t count, complex_t* out) const override {
+        for (size_t i = 0; i < count; ++i) {
+            out[i] = Load(indices[i]);
+        }
+    }
+
+    double ZeroThreshold() const override {
+        return RealTraits<Real>::kEps;
+    }
+
+private:
+    complex_t Load(int64_t index) const {
+        int64_t offset = 0;
+        for (auto stride : strides_) {
+            offset += (index & mask_) * stride;
+            index >>= log_width_;
+        }
+        return complex_t(data_[offset]);
+    }
+
+    const int log_width_;
+    const int64_t mask_;
+    const std::complex<Real>* data_;
+    const std::vector<int64_t> strides_;
+};
+
+using StridedSignal = BasicStridedSignal<double>;
+using FloatStridedSignal = BasicStridedSignal<float>;
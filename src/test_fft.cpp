@@ -3,8 +3,15 @@
 #include <random>
 #include <algorithm>
 #include <set>
+#include <numeric>
+#include <thread>
+#include <chrono>
 
 #include "utility_test.h"
+#include "mapped_signal.h"
+#include "streaming.h"
+#include "compact_signal.h"
+#include "strided_signal.h"
 
 
 TEST_CASE("Filters frequency simple 1") {
@@ -105,14 +112,14 @@ TEST_CASE("Filters frequency simple 5") {
 TEST_CASE("Filters frequency 2d 1") {
     auto tree = SplittingTree();
     auto root = tree.GetRoot();
-    auto a1 = root->MakeLeft();
+    root->MakeLeft();
     auto a2 = root->MakeRight();
-    auto b1 = a2->MakeLeft();
+    a2->MakeLeft();
     auto b2 = a2->MakeRight();
     auto c1 = b2->MakeLeft();
-    auto c2 = b2->MakeRight();
+    b2->MakeRight();
     auto d1 = c1->MakeLeft();
-    auto d2 = c1->MakeRight();
+    c1->MakeRight();
 
     SignalInfo info(2, 4);
 
@@ -125,6 +132,74 @@ TEST_CASE("Filters frequency 2d 1") {
     }
 }
 
+TEST_CASE("Filter taps match frequency response") {
+    auto tree = SplittingTree();
+    auto root = tree.GetRoot();
+    root->MakeLeft();
+    auto a2 = root->MakeRight();
+    a2->MakeLeft();
+    auto b2 = a2->MakeRight();
+    auto c1 = b2->MakeLeft();
+    b2->MakeRight();
+    c1->MakeLeft();
+    auto d2 = c1->MakeRight();
+
+    SignalInfo info(2, 8);
+
+    auto filter = Filter(tree, d2, info);
+    REQUIRE(filter.TapCount() == 16);
+    for (int64_t f = 0; f < info.SignalSize(); ++f) {
+        Key freq(info, f);
+        complex_t response = 0;
+        for (size_t j = 0; j < filter.TapCount(); ++j) {
+            Key tap(info, filter.TapOffsets()[j]);
+            response += complex_t(filter.TapReal()[j], filter.TapImag()[j]) * info.Roots()[-(freq * tap)];
+        }
+        REQUIRE(CheckEqual(response, filter.FilterFrequency(freq)));
+    }
+}
+
+std::vector<int> WalkRootPath(const Node* node) {
+    std::vector<int> path;
+    for (; node; node = node->Parent()) {
+        if (node->HasBothChild()) {
+            path.push_back(node->level);
+        }
+    }
+    std::reverse(path.begin(), path.end());
+    return path;
+}
+
+TEST_CASE("Memoized filters follow tree changes") {
+    SignalInfo info(2, 4);
+    std::mt19937_64 gen(5);
+    for (int iter = 0; iter < 20; ++iter) {
+        auto tree = SplittingTree();
+        std::vector<NodePtr> leafs = {tree.GetRoot()};
+        while (!leafs.empty()) {
+            for (const auto& node : leafs) {
+                auto memoized = GetNodeFilter(tree, node, info);
+                auto fresh = Filter(tree, node, info);
+                REQUIRE(tree.GetRootPath(node) == WalkRootPath(node.get()));
+                REQUIRE(memoized->Path() == fresh.Path());
+                for (int64_t f = 0; f < info.SignalSize(); ++f) {
+                    REQUIRE(CheckEqual(memoized->FilterFrequency(Key(info, f)), fresh.FilterFrequency(Key(info, f))));
+                }
+            }
+            auto pos = gen() % leafs.size();
+            auto node = leafs[pos];
+            leafs.erase(leafs.begin() + pos);
+            if (node->level < info.Dimensions() * info.LogSignalWidth() && gen() % 3) {
+                auto children = node->AddChildren();
+                leafs.push_back(children.first);
+                leafs.push_back(children.second);
+            } else {
+                tree.RemoveNode(node);
+            }
+        }
+    }
+}
+
 TEST_CASE("Filters time simple 1") {
     auto tree = SplittingTree();
     auto root = tree.GetRoot();
@@ -142,7 +217,7 @@ TEST_CASE("Filters time simple 2") {
     auto tree = SplittingTree();
     auto root = tree.GetRoot();
     auto a = root->MakeLeft();
-    auto b = root->MakeRight();
+    root->MakeRight();
     SignalInfo info(1, 2);
 
     auto filter = Filter(tree, a, info);
@@ -155,9 +230,9 @@ TEST_CASE("Filters time simple 2") {
 TEST_CASE("Filter full simple") {
     auto tree = SplittingTree();
     auto root = tree.GetRoot();
-    auto a1 = root->MakeLeft();
+    root->MakeLeft();
     auto a2 = root->MakeRight();
-    auto b1 = a2->MakeLeft();
+    a2->MakeLeft();
     auto b2 = a2->MakeRight();
     SignalInfo info(1, 4);
 
@@ -171,28 +246,139 @@ TEST_CASE("Filter full simple") {
     }
 }
 
+TEST_CASE("Roots of unity") {
+    for (int64_t n : {2, 8, 1 << 12, 1 << 20}) {
+        const auto& roots = SignalInfo(1, n).Roots();
+        REQUIRE(roots.Size() == n);
+        REQUIRE(&roots == &SignalInfo(2, n).Roots());
+        for (int64_t k : std::vector<int64_t>{0, 1, 3, n / 2 - 1, n - 1, n + 5, -1, -n - 3, 5 * n / 4 + 7}) {
+            REQUIRE(CheckEqual(roots[k], CalcKernel(static_cast<double>(k), static_cast<double>(n))));
+        }
+    }
+}
+
+TEST_CASE("SpectrumEvaluator kernels") {
+    std::mt19937_64 gen(17);
+    for (auto info : {SignalInfo(3, 8), SignalInfo(2, 1 << 10), SignalInfo(1, 1 << 20)}) {
+        std::uniform_int_distribution<int64_t> dist(0, info.SignalSize() - 1);
+        std::uniform_real_distribution<double> value(-1, 1);
+        std::vector<std::pair<Key, complex_t>> freqs;
+        for (int j = 0; j < 37; ++j) {
+            freqs.emplace_back(Key(info, dist(gen)), complex_t(value(gen), value(gen)));
+        }
+        std::vector<int64_t> times(11);
+        for (auto& time : times) {
+            time = dist(gen);
+        }
+        for (auto kernel : {SpectrumEvaluator::Kernel::kScalar, SpectrumEvaluator::Kernel::kAvx2, SpectrumEvaluator::Kernel::kAvx512}) {
+            if (!SpectrumEvaluator::IsSupported(kernel)) {
+                continue;
+            }
+            SpectrumEvaluator evaluator(info, kernel);
+            REQUIRE(evaluator.GetKernel() == kernel);
+            for (const auto& freq : freqs) {
+                evaluator.Add(freq.first, freq.second);
+            }
+            std::vector<complex_t> out(times.size());
+            evaluator.Evaluate(times.data(), static_cast<int>(times.size()), out.data());
+            for (size_t i = 0; i < times.size(); ++i) {
+                complex_t expected = 0;
+                for (const auto& freq : freqs) {
+                    expected += freq.second * CalcKernel(static_cast<double>(freq.first * Key(info, times[i])), static_cast<double>(info.SignalWidth()));
+                }
+                REQUIRE(CheckEqual(out[i], expected));
+            }
+        }
+    }
+}
+
+TEST_CASE("SpectrumEvaluator on signals wider than 2^32") {
+    const int64_t n = int64_t(1) << 33;
+    SignalInfo info(1, n);
+    const std::vector<int64_t> freqs{(int64_t(1) << 32) + 1, n - 3, 12345};
+    const std::vector<int64_t> times{1, (int64_t(1) << 32) + 5, n - 1};
+    SpectrumEvaluator evaluator(info);
+    REQUIRE(evaluator.GetKernel() == SpectrumEvaluator::Kernel::kScalar);
+    evaluator.Add(freqs[0], 1.);
+    evaluator.Add(Key(info, freqs[1]), 2.i);
+    evaluator.Add(freqs[2], -1.);
+    std::vector<complex_t> out(times.size());
+    evaluator.Evaluate(times.data(), static_cast<int>(times.size()), out.data());
+    const complex_t values[] = {1., 2.i, -1.};
+    for (size_t i = 0; i < times.size(); ++i) {
+        complex_t expected = 0;
+        for (size_t j = 0; j < freqs.size(); ++j) {
+            auto phase = (static_cast<uint64_t>(freqs[j]) * static_cast<uint64_t>(times[i])) & static_cast<uint64_t>(n - 1);
+            expected += values[j] * CalcKernel(static_cast<double>(phase), static_cast<double>(n));
+        }
+        REQUIRE(CheckEqual(out[i], expected));
+    }
+    // e^(2 pi i (2^32 + 1) / 2^33) is just past -1
+    SpectrumEvaluator single(info);
+    single.Add(freqs[0], 1.);
+    complex_t value;
+    single.Evaluate(times.data(), 1, &value);
+    REQUIRE(value.real() < -0.99);
+    REQUIRE(value.imag() < 0);
+}
+
+TEST_CASE("FrequencyMap") {
+    std::mt19937_64 gen(17);
+    std::uniform_int_distribution<int64_t> dist(0, 1 << 20);
+    FrequencyMap a, b;
+    std::unordered_map<int64_t, complex_t> expected;
+    for (int i = 0; i < 1000; ++i) {
+        int64_t key = dist(gen) & 1023;
+        a[key] += 1.;
+        expected[key] += 1.;
+        key = dist(gen) << 4;
+        b[key] += 1.i;
+        expected[key] += 1.i;
+    }
+    SignalInfo info(2, 1 << 20);
+    REQUIRE(a.find(Key(info, {1024, 0})) == a.end());
+    REQUIRE(a.emplace(1024, 2.).second);
+    REQUIRE(!a.emplace(1024, 3.).second);
+    REQUIRE(a.find(Key(info, {1024, 0}))->second == 2.);
+    a[1024] -= 2.;
+    a.Merge(std::move(b));
+    REQUIRE(a.size() == expected.size() + (expected.count(1024) ? 0 : 1));
+    for (const auto& value : expected) {
+        REQUIRE(a.count(value.first) == 1);
+        REQUIRE(a.find(value.first)->second == value.second);
+    }
+    auto sorted = a.Sorted();
+    REQUIRE(sorted.size() == a.size());
+    REQUIRE(std::is_sorted(sorted.begin(), sorted.end(), [](const auto& l, const auto& r) { return l.first < r.first; }));
+
+    FrequencyMap c;
+    c.Merge(FrequencyMap{{5, 1.}});
+    REQUIRE(c.size() == 1);
+    REQUIRE(c[5] == 1.);
+}
+
 TEST_CASE("Tree test remove") {
     auto tree = SplittingTree();
     auto root = tree.GetRoot();
     auto a = root->MakeLeft();
     auto b = root->MakeRight();
-    REQUIRE(root->left == a);
-    REQUIRE(root->right == b);
-    REQUIRE(a->parent == root.get());
-    REQUIRE(b->parent == root.get());
-    REQUIRE(root->parent == nullptr);
-    REQUIRE(a->left == nullptr);
-    REQUIRE(a->right == nullptr);
-    REQUIRE(b->left == nullptr);
-    REQUIRE(b->right == nullptr);
+    REQUIRE(root->Left() == a);
+    REQUIRE(root->Right() == b);
+    REQUIRE(a->Parent() == root.get());
+    REQUIRE(b->Parent() == root.get());
+    REQUIRE(root->Parent() == nullptr);
+    REQUIRE(a->Left() == nullptr);
+    REQUIRE(a->Right() == nullptr);
+    REQUIRE(b->Left() == nullptr);
+    REQUIRE(b->Right() == nullptr);
 
     tree.RemoveNode(a);
-    REQUIRE(root->left == nullptr);
-    REQUIRE(root->right == b);
-    REQUIRE(b->parent == root.get());
-    REQUIRE(root->parent == nullptr);
-    REQUIRE(b->left == nullptr);
-    REQUIRE(b->right == nullptr);
+    REQUIRE(root->Left() == nullptr);
+    REQUIRE(root->Right() == b);
+    REQUIRE(b->Parent() == root.get());
+    REQUIRE(root->Parent() == nullptr);
+    REQUIRE(b->Left() == nullptr);
+    REQUIRE(b->Right() == nullptr);
 
     tree.RemoveNode(b);
     REQUIRE(tree.IsEmpty());
@@ -234,11 +420,11 @@ TEST_CASE("Tree get lightest 2") {
 }
 
 std::pair<int, NodePtr> CustomGetLightest(NodePtr node) {
-    if (!node->left && !node->right) {
+    if (!node->Left() && !node->Right()) {
         return {0, node};
     }
     std::vector<std::pair<int, NodePtr>> results;
-    for (auto& child : {node->right, node->left}) {
+    for (auto& child : {node->Right(), node->Left()}) {
         if (child) {
             results.push_back(CustomGetLightest(child));
         }
@@ -281,6 +467,93 @@ TEST_CASE("Huge tree test 1") {
     REQUIRE(tree.IsEmpty());
 }
 
+TEST_CASE("Tree arena keeps removed nodes") {
+    auto tree = SplittingTree();
+    std::vector<NodePtr> leafs = {tree.GetRoot()};
+    std::vector<NodePtr> removed;
+    for (int i = 0; i < 200; ++i) {
+        auto node = leafs.back();
+        leafs.pop_back();
+        auto children = node->AddChildren();
+        REQUIRE(children.first->Parent() == node.get());
+        REQUIRE(children.second->Parent() == node.get());
+        REQUIRE(children.first->label == node->label + (int64_t(1) << node->level));
+        leafs.push_back(children.first);
+        leafs.push_back(children.second);
+        if (i % 3 == 0) {
+            tree.RemoveNode(leafs.front());
+            removed.push_back(leafs.front());
+            leafs.erase(leafs.begin());
+        }
+    }
+    for (const auto& node : removed) {
+        REQUIRE(node->Removed());
+    }
+    for (const auto& node : leafs) {
+        REQUIRE(!node->Removed());
+        REQUIRE(node->level > node->Parent()->level);
+    }
+    REQUIRE(tree.LeavesCount() == static_cast<int>(leafs.size()));
+}
+
+TEST_CASE("Nested trees reuse the arenas of finished ones") {
+    auto tree = SplittingTree();
+    auto parent = tree.GetRoot()->MakeLeft();
+    SplittingTree::Node* first_root;
+    {
+        SplittingTree nested(&tree, parent);
+        first_root = nested.GetRoot().get();
+        auto children = nested.GetRoot()->AddChildren();
+        children.first->AddChildren();
+        nested.GetRoot()->residuals.times.push_back(1);
+        REQUIRE(nested.LeavesCount() == 3);
+    }
+    SplittingTree nested(&tree, parent);
+    auto root = nested.GetRoot();
+    REQUIRE(root.get() == first_root);
+    REQUIRE(!root->Left());
+    REQUIRE(!root->Right());
+    REQUIRE(root->label == parent->label);
+    REQUIRE(root->residuals.times.empty());
+    REQUIRE(nested.LeavesCount() == 1);
+    auto child = root->MakeRight();
+    REQUIRE(!child->Left());
+    REQUIRE(child->Parent() == root.get());
+}
+
+int CountLeaves(const NodePtr& node) {
+    if (!node->Left() && !node->Right()) {
+        return 1;
+    }
+    return (node->Left() ? CountLeaves(node->Left()) : 0) + (node->Right() ? CountLeaves(node->Right()) : 0);
+}
+
+TEST_CASE("Tree statistics follow changes") {
+    std::mt19937_64 gen(3);
+    for (int iter = 0; iter < 20; ++iter) {
+        auto tree = SplittingTree();
+        std::vector<NodePtr> leafs = {tree.GetRoot()};
+        while (!leafs.empty()) {
+            REQUIRE(tree.LeavesCount() == CountLeaves(tree.GetRoot()));
+            REQUIRE(tree.LeavesCount() == static_cast<int>(leafs.size()));
+            REQUIRE(tree.GetLightestNode() == CustomGetLightest(tree.GetRoot()).second);
+            auto pos = gen() % leafs.size();
+            auto node = leafs[pos];
+            if (node->level < 12 && gen() % 3) {
+                leafs.erase(leafs.begin() + pos);
+                auto children = node->AddChildren();
+                leafs.push_back(children.first);
+                leafs.push_back(children.second);
+            } else {
+                leafs.erase(leafs.begin() + pos);
+                tree.RemoveNode(node);
+            }
+        }
+        REQUIRE(tree.IsEmpty());
+        REQUIRE(tree.LeavesCount() == 0);
+    }
+}
+
 TEST_CASE("DataSignal") {
     complex_t data[] = {0, 1, 2, 3, 4, 5, 6, 7};
     SignalInfo info(1, 8);
@@ -309,6 +582,66 @@ TEST_CASE("Key multidim") {
     REQUIRE(-a == Key(info, {4, 3, 5}));
 }
 
+TEST_CASE("Packed key arithmetic") {
+    std::mt19937_64 gen(17);
+    for (auto dims : std::vector<std::pair<int, int64_t>>{{1, 2}, {3, 8}, {12, 4}, {5, 2}, {2, 1024}}) {
+        SignalInfo info(dims.first, dims.second);
+        std::uniform_int_distribution<int64_t> dist(0, info.SignalSize() - 1);
+        for (int t = 0; t < 100; ++t) {
+            Key a(info, dist(gen)), b(info, dist(gen));
+            Key diff(info), sum(info);
+            diff.StoreDifference(a, b);
+            for (int i = 0; i < info.Dimensions(); ++i) {
+                sum[i] = (a[i] + b[i]) % info.SignalWidth();
+            }
+            REQUIRE(info.FlatDifference(a.Flatten(), b.Flatten()) == diff.Flatten());
+            REQUIRE(info.FlatSum(a.Flatten(), b.Flatten()) == sum.Flatten());
+            REQUIRE(info.FlatNegate(a.Flatten()) == (-a).Flatten());
+        }
+    }
+}
+
+TEST_CASE("Key static dimensions") {
+    SignalInfo info(3, 8);
+    BasicSignalInfo<3> static_info(info);
+    REQUIRE(static_info.Dimensions() == 3);
+    REQUIRE(static_info.SignalSize() == info.SignalSize());
+    BasicKey<3> a(static_info, {4, 5, 3}), b(static_info, {7, 4, 7});
+    BasicKey<3> buf(static_info);
+    buf.StoreDifference(a, b);
+    REQUIRE(buf == BasicKey<3>(static_info, {5, 1, 4}));
+    buf.StoreDifference(a, Key(info, {7, 4, 7}).Flatten());
+    REQUIRE(buf == BasicKey<3>(static_info, {5, 1, 4}));
+    REQUIRE(a * b == 4 * 7 + 5 * 4 + 7 * 3);
+    REQUIRE(a.IncreaseAt(1, 3) == BasicKey<3>(static_info, {4, 0, 3}));
+    REQUIRE((-a).Flatten() == (-Key(info, {4, 5, 3})).Flatten());
+    REQUIRE(BasicKey<3>(static_info, a.Flatten()) == a);
+}
+
+TEST_CASE("Static dimensions transform matches dynamic") {
+    SignalInfo info(2, 8);
+    std::vector<complex_t> data(info.SignalSize());
+    FrequencyMap spectrum{{Key(info, {1, 6}).Flatten(), 2.}, {Key(info, {5, 3}).Flatten(), -1.i}, {Key(info, {7, 7}).Flatten(), 0.5}};
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        Key time(info, t);
+        for (const auto& freq : spectrum) {
+            data[t] += freq.second * CalcKernel(static_cast<double>(Key(info, freq.first) * time), 8) / 64.;
+        }
+    }
+    DataSignal x(info, data.data());
+    for (int rank : {1, 2}) {
+        auto dynamic = RecursiveSparseFFTImpl(x, info, 3, rank, 61, TransformSettings{});
+        auto result = RecursiveSparseFFT(x, info, 3, rank);
+        REQUIRE(result.size() == dynamic.size());
+        for (const auto& freq : dynamic) {
+            REQUIRE(CheckEqual(result[freq.first], freq.second));
+        }
+        for (const auto& freq : spectrum) {
+            REQUIRE(CheckEqual(result[freq.first], freq.second));
+        }
+    }
+}
+
 TEST_CASE("ZeroTest 1") {
     auto tree = SplittingTree();
     auto root = tree.GetRoot();
@@ -348,7 +681,7 @@ TEST_CASE("ZeroTest 1") {
 TEST_CASE("ZeroTest 1.5") {
     auto tree = SplittingTree();
     auto root = tree.GetRoot();
-    auto a1 = root->MakeLeft();
+    root->MakeLeft();
     auto a2 = root->MakeRight();
     auto b1 = a2->MakeLeft();
     auto b2 = a2->MakeRight();
@@ -456,6 +789,132 @@ TEST_CASE("ZeroTest 2") {
     }
 }
 
+TEST_CASE("ZeroTest residual cache") {
+    auto tree = SplittingTree();
+    auto root = tree.GetRoot();
+    auto a = root->MakeRight();
+    auto b1 = root->MakeLeft();
+    auto b2 = b1->MakeLeft();
+    auto b3 = b2->MakeRight();
+    SignalInfo info(1, 8);
+    IndexGenerator delta(info, 321);
+    TransformSettings settings;
+
+    // ifft([0, 0, 0, 1, 0, 0, 0, 0])
+    complex_t data[] = {0.125     +0.i        , -0.08838835+0.08838835i,
+                        0.        -0.125i     ,  0.08838835+0.08838835i,
+                        -0.125     +0.i        ,  0.08838835-0.08838835i,
+                        0.        +0.125i     , -0.08838835-0.08838835i };
+    DataSignal x(info, data);
+    KnownFrequencies known({});
+    FrequencyMap half{{3, 0.5}};
+
+    REQUIRE(!ZeroTest(x, known, nullptr, tree, a, info, 2, delta, settings));
+    REQUIRE(a->residuals.times.size() == 6);
+    REQUIRE(ZeroTest(x, known, nullptr, tree, b3, info, 2, delta, settings));
+    REQUIRE(ZeroTest(x, known, &half, tree, b3, info, 2, delta, settings));
+    known.Add(half);
+    REQUIRE(ZeroTest(x, known, nullptr, tree, b3, info, 2, delta, settings));
+    REQUIRE(!ZeroTest(x, known, &half, tree, b3, info, 2, delta, settings));
+    REQUIRE(b3->residuals.version == 1);
+    REQUIRE(b3->residuals.times.size() == 6);
+    known.Add(half);
+    REQUIRE(!ZeroTest(x, known, nullptr, tree, b3, info, 2, delta, settings));
+    REQUIRE(!ZeroTest(x, known, nullptr, tree, a, info, 2, delta, settings));
+    REQUIRE(b3->residuals.version == 2);
+    REQUIRE(b3->residuals.times.size() == 6);
+}
+
+TEST_CASE("ZeroTest parallel sampling") {
+    SignalInfo info(1, 1024);
+    auto tree = SplittingTree();
+    auto root = tree.GetRoot();
+    auto odd = root->MakeLeft();
+    auto even = root->MakeRight();
+    // single frequency 3
+    std::vector<complex_t> data(info.SignalSize());
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        data[t] = CalcKernel(static_cast<double>(3 * t), 1024) / 1024.;
+    }
+    DataSignal x(info, data.data());
+    ThreadPool pool(4);
+    TransformSettings settings;
+    settings.thread_pool = &pool;
+    settings.parallel_zero_test = true;
+    IndexGenerator delta(info, 321);
+    KnownFrequencies known({});
+    FrequencyMap three{{3, 1.}};
+
+    // max_iters = 32 * log2(1024) samples, split between tasks
+    REQUIRE(!ZeroTest(x, known, nullptr, tree, even, info, 32, delta, settings));
+    REQUIRE(even->residuals.times.size() == 320);
+    REQUIRE(ZeroTest(x, known, nullptr, tree, odd, info, 32, delta, settings));
+    REQUIRE(!ZeroTest(x, known, &three, tree, odd, info, 32, delta, settings));
+    REQUIRE(odd->residuals.times.size() == 320);
+    auto times = odd->residuals.times;
+    std::sort(times.begin(), times.end());
+    REQUIRE(std::unique(times.begin(), times.end()) - times.begin() > 250);
+}
+
+// reads take a while, so that parallel chunks stop each other at different points
+class SlowSignal: public Signal {
+public:
+    explicit SlowSignal(const DataSignal& data): data_(data) {
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        return data_.ValueAtTime(key);
+    }
+
+    void ValuesAtIndices(const SignalInfo& info, const int64_t* indices, size_t count, complex_t* out) const override {
+        std::this_thread::sleep_for(std::chrono::microseconds(20));
+        data_.ValuesAtIndices(info, indices, count, out);
+    }
+
+private:
+    const DataSignal& data_;
+};
+
+TEST_CASE("ZeroTest parallel sampling is deterministic") {
+    SignalInfo info(1, 1024);
+    // a tone just above the threshold, only samples near the axes are nonzero,
+    // so chunks find nonzero samples at scattered positions
+    const double amplitude = 1.0001 * EPS * 1024;
+    std::vector<complex_t> data(info.SignalSize());
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        data[t] = amplitude * CalcKernel(static_cast<double>(3 * t), 1024) / 1024.;
+    }
+    DataSignal data_signal(info, data.data());
+    SlowSignal x(data_signal);
+    ThreadPool pool(4);
+    TransformSettings settings;
+    settings.thread_pool = &pool;
+    settings.parallel_zero_test = true;
+    FrequencyMap three{{3, amplitude}};
+
+    std::vector<int64_t> first;
+    for (int run = 0; run < 20; ++run) {
+        auto tree = SplittingTree();
+        auto root = tree.GetRoot();
+        auto odd = root->MakeLeft();
+        root->MakeRight();
+        IndexGenerator delta(info, 321);
+        KnownFrequencies known({});
+        std::vector<int64_t> trace;
+        REQUIRE(ZeroTest(x, known, nullptr, tree, odd, info, 32, delta, settings));
+        trace.push_back(odd->residuals.times.size());
+        REQUIRE(!ZeroTest(x, known, &three, tree, odd, info, 32, delta, settings));
+        trace.push_back(odd->residuals.times.size());
+        for (int i = 0; i < 4; ++i) {
+            trace.push_back(delta.NextIndex());
+        }
+        if (run == 0) {
+            first = trace;
+        }
+        REQUIRE(trace == first);
+    }
+}
+
 TEST_CASE("SparseFFT 1") {
     SignalInfo info{1, 4};
     REQUIRE(RunSFFT(info, 0,
@@ -497,3 +956,358 @@ TEST_CASE("SparseFFT 2") {
                     {1, 0, 0, 0, 4, 5, 0, 0}
     ));
 }
+
+class KeySignal: public Signal {
+public:
+    explicit KeySignal(const DataSignal& data): data_(data) {
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        return data_.ValueAtTime(key);
+    }
+
+private:
+    const DataSignal& data_;
+};
+
+TEST_CASE("Comb bucketing gathers shifted samples") {
+    SignalInfo info{3, 16};
+    std::mt19937 gen(7);
+    std::normal_distribution<double> dist;
+    std::vector<complex_t> values(info.SignalSize());
+    for (auto& value : values) {
+        value = complex_t(dist(gen), dist(gen));
+    }
+    DataSignal data(info, values.data());
+    KeySignal generic(data);
+    std::vector<int> w_combs{4, 2, 8};
+    const int total = 4 * 2 * 8;
+    for (auto shift : {std::vector<int64_t>{0, 0, 0}, std::vector<int64_t>{15, 3, 0}, std::vector<int64_t>{6, 15, 9}}) {
+        Key a(info, shift);
+        std::vector<complex_t> expected(total);
+        for (int h0 = 0; h0 < 4; ++h0) {
+            for (int h1 = 0; h1 < 2; ++h1) {
+                for (int h2 = 0; h2 < 8; ++h2) {
+                    Key time(info, {(h0 * 4 + shift[0]) % 16, (h1 * 8 + shift[1]) % 16, (h2 * 2 + shift[2]) % 16});
+                    expected[(h0 * 2 + h1) * 8 + h2] = values[time.Flatten()];
+                }
+            }
+        }
+        for (const Signal* x : {static_cast<const Signal*>(&data), static_cast<const Signal*>(&generic)}) {
+            std::vector<complex_t> u(total);
+            ComputeCombBucketedSignal(info, a, w_combs.data(), *x, u.data());
+            for (int i = 0; i < total; ++i) {
+                REQUIRE(std::abs(u[i] - expected[i]) < 1e-12);
+            }
+        }
+    }
+}
+
+class BatchCountingSignal: public Signal {
+public:
+    explicit BatchCountingSignal(const DataSignal& data): data_(data) {
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        ++single_calls;
+        return data_.ValueAtTime(key);
+    }
+
+    void ValuesAtIndices(const SignalInfo& info, const int64_t* indices, size_t count, complex_t* out) const override {
+        ++batch_calls;
+        batch_values += count;
+        data_.ValuesAtIndices(info, indices, count, out);
+    }
+
+    mutable int64_t single_calls{0};
+    mutable int64_t batch_calls{0};
+    mutable int64_t batch_values{0};
+
+private:
+    const DataSignal& data_;
+};
+
+TEST_CASE("ZeroTest requests filter taps in batches") {
+    SignalInfo info(1, 1024);
+    auto tree = SplittingTree();
+    auto root = tree.GetRoot();
+    auto odd = root->MakeLeft();
+    root->MakeRight();
+    std::vector<complex_t> data(info.SignalSize());
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        data[t] = CalcKernel(static_cast<double>(3 * t), 1024) / 1024.;
+    }
+    DataSignal x(info, data.data());
+    BatchCountingSignal counting(x);
+    IndexGenerator delta(info, 321);
+    KnownFrequencies known({});
+    FrequencyMap three{{3, 1.}};
+
+    REQUIRE(!ZeroTest(counting, known, &three, tree, odd, info, 32, delta, TransformSettings()));
+    auto samples = static_cast<int64_t>(odd->residuals.times.size());
+    REQUIRE(samples == 320);
+    REQUIRE(counting.single_calls == 0);
+    // two taps per sample at the first level, up to kZeroTestMaxBatch samples per request
+    REQUIRE(counting.batch_values == 2 * samples);
+    REQUIRE(counting.batch_calls < samples / 4);
+}
+
+TEST_CASE("Data signal batched reads") {
+    SignalInfo info(2, 64);
+    std::vector<complex_t> data(info.SignalSize());
+    std::vector<std::complex<float>> float_data(info.SignalSize());
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        data[t] = complex_t(static_cast<double>(t), 0.5 - static_cast<double>(t));
+        float_data[t] = std::complex<float>(data[t]);
+    }
+    DataSignal x(info, data.data());
+    FloatDataSignal x_float(info, float_data.data());
+    DataSignal x_scaled(info, data.data(), 0.25);
+    std::mt19937 gen(11);
+    // odd count, so that a sample is left for the scalar tail
+    std::vector<int64_t> indices(101);
+    for (auto& index : indices) {
+        index = static_cast<int64_t>(gen() % info.SignalSize());
+    }
+    for (const Signal* signal : {static_cast<const Signal*>(&x), static_cast<const Signal*>(&x_float)}) {
+        std::vector<complex_t> values(indices.size());
+        signal->ValuesAtIndices(info, indices.data(), indices.size(), values.data());
+        for (size_t i = 0; i < indices.size(); ++i) {
+            REQUIRE(values[i] == data[indices[i]]);
+        }
+    }
+    std::vector<complex_t> scaled(indices.size());
+    x_scaled.ValuesAtIndices(info, indices.data(), indices.size(), scaled.data());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        REQUIRE(scaled[i] == 0.25 * data[indices[i]]);
+        REQUIRE(x_scaled.ValueAtIndex(info, indices[i]) == scaled[i]);
+    }
+}
+
+TEST_CASE("Mapped file signal") {
+    SignalInfo info(1, 1 << 16);
+    std::vector<complex_t> data(info.SignalSize());
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        data[t] = (CalcKernel(static_cast<double>(3 * t), 1 << 16) + 2. * CalcKernel(static_cast<double>(1000 * t), 1 << 16)) /
+                  static_cast<double>(1 << 16);
+    }
+    std::vector<float> data_float;
+    for (auto value : data) {
+        data_float.push_back(static_cast<float>(value.real()));
+        data_float.push_back(static_cast<float>(value.imag()));
+    }
+    TransformSettings settings;
+    settings.use_comb = false;
+    for (auto format : {SampleFormat::Complex128, SampleFormat::Complex64}) {
+        char path[] = "/tmp/sfft_mapped_XXXXXX";
+        int fd = mkstemp(path);
+        REQUIRE(fd >= 0);
+        const void* bytes = format == SampleFormat::Complex128 ? static_cast<const void*>(data.data()) : data_float.data();
+        size_t size = format == SampleFormat::Complex128 ? data.size() * sizeof(complex_t) : data_float.size() * sizeof(float);
+        REQUIRE(write(fd, bytes, size) == static_cast<ssize_t>(size));
+        close(fd);
+
+        MappedFileSignal x(info, path, format);
+        REQUIRE(std::abs(x.ValueAtTime(Key(info, 5)) - data[5]) < 1e-9);
+        x.ResetPagesTouched();
+        auto result = RecursiveSparseFFT(x, info, 2, 1, 61, settings);
+        REQUIRE(result.size() == 2);
+        REQUIRE(CheckEqual(result[3], 1.));
+        REQUIRE(CheckEqual(result[1000], 2.));
+        REQUIRE(x.PagesTouched() > 0);
+        REQUIRE(x.PagesTouched() <= x.PagesTotal());
+        unlink(path);
+    }
+    REQUIRE_THROWS(MappedFileSignal(info, "/nonexistent/sfft_signal"));
+}
+
+TEST_CASE("Sample schedule") {
+    std::vector<int64_t> indices{40, 7, 40, 3, 7, 100};
+    SampleSchedule schedule;
+    schedule.Assign(indices.data(), indices.size());
+    REQUIRE(schedule.Indices() == std::vector<int64_t>{3, 7, 40, 100});
+    std::vector<complex_t> values{3., 7., 40., 100.};
+    std::vector<complex_t> out(indices.size());
+    schedule.Scatter(values.data(), out.data());
+    for (size_t i = 0; i < indices.size(); ++i) {
+        REQUIRE(CheckEqual(out[i], static_cast<double>(indices[i])));
+    }
+
+    // a batch read from a mapped file goes through the schedule
+    SignalInfo info(1, 1 << 14);
+    std::vector<complex_t> data(info.SignalSize());
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        data[t] = complex_t(static_cast<double>(t), -static_cast<double>(t));
+    }
+    char path[] = "/tmp/sfft_schedule_XXXXXX";
+    int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, data.data(), data.size() * sizeof(complex_t)) == static_cast<ssize_t>(data.size() * sizeof(complex_t)));
+    close(fd);
+    MappedFileSignal x(info, path);
+    std::mt19937 gen(5);
+    std::vector<int64_t> batch(100);
+    for (auto& index : batch) {
+        index = gen() % 64 * 256;
+    }
+    std::vector<complex_t> batch_values(batch.size());
+    x.ValuesAtIndices(info, batch.data(), batch.size(), batch_values.data());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        REQUIRE(CheckEqual(batch_values[i], data[batch[i]]));
+    }
+    unlink(path);
+}
+
+TEST_CASE("Streaming sparse FFT") {
+    struct Tone {
+        std::vector<int64_t> freq;
+        complex_t value;
+        int64_t from;
+    };
+    for (int d : {1, 2}) {
+        SignalInfo info(d, d == 1 ? 1024 : 32);
+        int64_t n = info.SignalWidth();
+        // the last coordinate of a frequency is along the time axis
+        std::vector<Tone> tones;
+        if (d == 1) {
+            tones = {{{3}, 1., 0}, {{100}, 2. - 1.i, 0}, {{500}, 1.5, 1500}};
+        } else {
+            tones = {{{3, 1}, 1., 0}, {{17, 20}, 2. - 1.i, 0}, {{30, 7}, 1.5, 50}};
+        }
+        StreamingSparseFFT stream(info, 4, 2, 1, n / 8);
+        std::vector<complex_t> step(stream.StepSize());
+        int checked = 0;
+        for (int64_t time = 0; time < 4 * n; ++time) {
+            for (int64_t s = 0; s < stream.StepSize(); ++s) {
+                step[s] = 0;
+                for (const auto& tone : tones) {
+                    if (time >= tone.from) {
+                        int64_t phase = tone.freq.back() * time + (d == 2 ? tone.freq[0] * s : 0);
+                        step[s] += tone.value * CalcKernel(static_cast<double>(phase % n), static_cast<double>(n)) /
+                                   static_cast<double>(info.SignalSize());
+                    }
+                }
+            }
+            if (!stream.Push(step.data())) {
+                continue;
+            }
+            int64_t start = stream.Pushed() - n;
+            FrequencyMap expected;
+            bool clean = true;
+            for (const auto& tone : tones) {
+                clean = clean && (start >= tone.from || start + n <= tone.from);
+                if (start >= tone.from) {
+                    auto phase = static_cast<double>(tone.freq.back() * start % n);
+                    expected[Key(info, tone.freq)] = tone.value * CalcKernel(phase, static_cast<double>(n));
+                }
+            }
+            if (!clean) {
+                continue;
+            }
+            ++checked;
+            const auto& spectrum = stream.Spectrum();
+            REQUIRE(spectrum.size() == expected.size());
+            for (const auto& freq : expected) {
+                REQUIRE(spectrum.count(freq.first));
+                REQUIRE(CheckEqual(spectrum.find(freq.first)->second, freq.second));
+            }
+        }
+        REQUIRE(checked > 8);
+    }
+}
+
+TEST_CASE("Half precision samples") {
+    REQUIRE(CheckEqual(SampleToDouble(Half{0x3c00}), 1.));
+    REQUIRE(CheckEqual(SampleToDouble(Half{0xc000}), -2.));
+    REQUIRE(CheckEqual(SampleToDouble(Half{0x3555}), 0.333251953125));
+    REQUIRE(CheckEqual(SampleToDouble(Half{0x7bff}), 65504.));
+    REQUIRE(SampleToDouble(Half{0x0001}) == std::ldexp(1., -24));
+    REQUIRE(SampleToDouble(Half{0x03ff}) == std::ldexp(1023., -24));
+    REQUIRE(std::isinf(SampleToDouble(Half{0xfc00})));
+    REQUIRE(std::isnan(SampleToDouble(Half{0x7e00})));
+}
+
+TEST_CASE("Compact signals") {
+    SignalInfo info(1, 1024);
+    // 7 + 3 i^t + 5 (-1)^t has frequencies 0, n / 4 and n / 2 and integer samples
+    std::vector<int8_t> int8;
+    std::vector<int16_t> int16;
+    std::vector<Half> half;
+    std::vector<std::complex<float>> float32;
+    std::vector<complex_t> float64;
+    const int8_t powers_of_i[4][2] = {{1, 0}, {0, 1}, {-1, 0}, {0, -1}};
+    for (int64_t t = 0; t < info.SignalSize(); ++t) {
+        int re = 7 + 3 * powers_of_i[t % 4][0] + (t % 2 ? -5 : 5);
+        int im = 3 * powers_of_i[t % 4][1];
+        for (int value : {re, im}) {
+            int8.push_back(static_cast<int8_t>(value));
+            int16.push_back(static_cast<int16_t>(value * 100));
+            // halves of the integers from -15 to 15
+            int magnitude = std::abs(value);
+            uint16_t bits = 0;
+            if (magnitude) {
+                int exponent = CalcLog(magnitude);
+                bits = static_cast<uint16_t>(((exponent + 15) << 10) | ((magnitude << (10 - exponent)) & 0x3ff));
+            }
+            half.push_back(Half{static_cast<uint16_t>(bits | (value < 0 ? 0x8000 : 0))});
+        }
+        float32.emplace_back(static_cast<float>(re), static_cast<float>(im));
+        float64.emplace_back(re, im);
+    }
+    Int8Signal x8(info, int8.data(), 1. / 1024);
+    Int16Signal x16(info, int16.data(), 1. / 102400);
+    HalfSignal x_half(info, half.data(), 1. / 1024);
+    FloatDataSignal x32(info, float32.data(), 1. / 1024);
+    DataSignal x64(info, float64.data(), 1. / 1024);
+    for (const Signal* x : {static_cast<const Signal*>(&x8), static_cast<const Signal*>(&x16), static_cast<const Signal*>(&x_half),
+                            static_cast<const Signal*>(&x32), static_cast<const Signal*>(&x64)}) {
+        REQUIRE(CheckEqual(x->ValueAtTime(Key(info, 1)), (7. - 5. + 3.i) / 1024.));
+        auto result = RecursiveSparseFFT(*x, info, 3, 1);
+        // wrong frequencies of the comb are left cancelled to rounding errors
+        REQUIRE(std::count_if(result.begin(), result.end(), [](const auto& freq) { return NonZero(freq.second); }) == 3);
+        REQUIRE(CheckEqual(result[0], 7.));
+        REQUIRE(CheckEqual(result[256], 3.));
+        REQUIRE(CheckEqual(result[512], 5.));
+    }
+}
+
+TEST_CASE("Strided signal views") {
+    SignalInfo info(2, 32);
+    std::vector<complex_t> dense(info.SignalSize());
+    for (int64_t k1 = 0; k1 < 32; ++k1) {
+        for (int64_t k0 = 0; k0 < 32; ++k0) {
+            dense[k0 + 32 * k1] = (CalcKernel(static_cast<double>(3 * k0 + 7 * k1), 32) +
+                                   (2. - 1.i) * CalcKernel(static_cast<double>(20 * k0 + 11 * k1), 32)) / 1024.;
+        }
+    }
+    // channel 1 of three interleaved channels
+    std::vector<complex_t> interleaved(3 * info.SignalSize(), 5.);
+    // transposed array
+    std::vector<complex_t> transposed(info.SignalSize());
+    // sub-volume at (3, 5) of a 40 x 48 array
+    std::vector<complex_t> large(40 * 48, -1.);
+    for (int64_t k1 = 0; k1 < 32; ++k1) {
+        for (int64_t k0 = 0; k0 < 32; ++k0) {
+            interleaved[3 * (k0 + 32 * k1) + 1] = dense[k0 + 32 * k1];
+            transposed[k1 + 32 * k0] = dense[k0 + 32 * k1];
+            large[(k0 + 3) + 40 * (k1 + 5)] = dense[k0 + 32 * k1];
+        }
+    }
+    std::vector<StridedSignal> views;
+    views.emplace_back(info, interleaved.data(), StridedSignal::DenseStrides(info, 3), 0, 1, 1);
+    views.emplace_back(info, transposed.data(), std::vector<int64_t>{32, 1});
+    views.emplace_back(info, large.data(), std::vector<int64_t>{1, 40}, 3 + 40 * 5);
+
+    DataSignal x(info, dense.data());
+    auto expected = RecursiveSparseFFT(x, info, 2, 1).Sorted();
+    REQUIRE(expected.size() == 2);
+    std::vector<int64_t> indices(info.SignalSize());
+    std::iota(indices.begin(), indices.end(), 0);
+    std::vector<complex_t> values(info.SignalSize());
+    for (const auto& view : views) {
+        view.ValuesAtIndices(info, indices.data(), indices.size(), values.data());
+        REQUIRE(std::equal(dense.begin(), dense.end(), values.begin(), CheckEqual));
+        REQUIRE(CheckEqual(view.ValueAtTime(Key(info, {4, 9})), dense[4 + 32 * 9]));
+        REQUIRE(RecursiveSparseFFT(view, info, 2, 1).Sorted() == expected);
+    }
+}
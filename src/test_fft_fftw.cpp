@@ -128,3 +128,227 @@ TEST_CASE("FFT 4d 1048576 comb") {
     }
     REQUIRE(RunFFTWTest(out, info, sparsity));
 }
+
+TEST_CASE("FFT 2d 1024 thread pool") {
+    SignalInfo info{2, 32};
+    const int64_t sparsity = 32;
+    std::vector<complex_t> out(info.SignalSize());
+    for (int i = 0; i < info.SignalSize(); i += info.SignalSize() / sparsity) {
+        size_t j = random() % info.SignalSize();
+        int id = i % 9;
+        out[j] = (id + 1.) + (3. * id - 1.) * 1.i;
+    }
+    ThreadPool pool(4);
+    TransformSettings settings;
+    settings.use_comb = false;
+    settings.thread_pool = &pool;
+    for (int rank : {1, 2}) {
+        REQUIRE(RunFFTWTest(out, info, sparsity, rank, 61, settings));
+    }
+    // samples of every test are drawn from its own stream, so the result does not depend on scheduling
+    auto in = FFTWRunner(info, FFTW_BACKWARD).Run(out);
+    DataSignal x(info, in.data());
+    auto first = RecursiveSparseFFT(x, info, sparsity, 2, 5, settings).Sorted();
+    for (int iter = 0; iter < 3; ++iter) {
+        REQUIRE(RecursiveSparseFFT(x, info, sparsity, 2, 5, settings).Sorted() == first);
+    }
+}
+
+TEST_CASE("Comb filtration on several threads") {
+    SignalInfo info{3, 16};
+    std::vector<complex_t> out(info.SignalSize());
+    Key freq(info, {5, 7, 2});
+    out[freq.Flatten()] = 2. - 1.i;
+    auto in = FFTWRunner(info, FFTW_BACKWARD).Run(out);
+    DataSignal x(info, in.data());
+    // every thread hashes into its own buffer with the shared plan
+    std::vector<FrequencyMap> found(4);
+    std::vector<std::thread> threads;
+    for (auto& res : found) {
+        threads.emplace_back([&] {
+            for (int iter = 0; iter < 3; ++iter) {
+                res.clear();
+                CombFiltration(x, info, 1, res);
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    for (const auto& res : found) {
+        REQUIRE(res.size() == 1);
+        REQUIRE(res.count(freq.Flatten()));
+        REQUIRE(std::abs(res.find(freq)->second - (2. - 1.i)) < 1e-6);
+    }
+}
+
+class CountingSignal: public Signal {
+public:
+    explicit CountingSignal(const DataSignal& data): data_(data) {
+    }
+
+    complex_t ValueAtTime(const Key& key) const override {
+        ++samples;
+        return data_.ValueAtTime(key);
+    }
+
+    void ValuesAtIndices(const SignalInfo& info, const int64_t* indices, size_t count, complex_t* out) const override {
+        samples += count;
+        data_.ValuesAtIndices(info, indices, count, out);
+    }
+
+    mutable int64_t samples{0};
+
+private:
+    const DataSignal& data_;
+};
+
+TEST_CASE("FFT 2d 1024 warm start") {
+    SignalInfo info{2, 32};
+    const int64_t sparsity = 32;
+    std::vector<complex_t> previous(info.SignalSize());
+    std::mt19937 gen(3);
+    for (int i = 0; i < sparsity; ++i) {
+        previous[gen() % info.SignalSize()] = complex_t(1. + i, 2. - i);
+    }
+    FrequencyMap hint;
+    for (int64_t i = 0; i < info.SignalSize(); ++i) {
+        if (NonZero(previous[i])) {
+            hint[i] = previous[i];
+        }
+    }
+    // the next frame: one frequency changed, one vanished, one appeared
+    auto out = previous;
+    auto support = hint.Sorted();
+    out[support[0].first] += 0.5;
+    out[support[1].first] = 0.;
+    out[(support[2].first + 1) % info.SignalSize()] = 3. + 1.i;
+
+    TransformSettings settings;
+    auto in = FFTWRunner(info, FFTW_BACKWARD).Run(out);
+    DataSignal data(info, in.data());
+    for (int rank : {1, 2}) {
+        CountingSignal cold_x(data);
+        auto cold = RecursiveSparseFFT(cold_x, info, sparsity + 2, rank, 61, settings);
+        CountingSignal x(data);
+        auto warm = WarmStartSparseFFT(x, info, hint, 4, rank, 61, settings);
+        auto result = GetSignalFromMap(warm, info);
+        REQUIRE(std::equal(out.begin(), out.end(), result.begin(), CheckEqual));
+        REQUIRE(warm.size() == static_cast<size_t>(std::count_if(out.begin(), out.end(), [](complex_t value) { return NonZero(value); })));
+        REQUIRE(x.samples < cold_x.samples);
+
+        // an exact hint only has to be verified
+        CountingSignal same_x(data);
+        FrequencyMap exact;
+        for (int64_t i = 0; i < info.SignalSize(); ++i) {
+            if (NonZero(out[i])) {
+                exact[i] = out[i];
+            }
+        }
+        REQUIRE(WarmStartSparseFFT(same_x, info, exact, 4, rank, 61, settings).Sorted() == exact.Sorted());
+        REQUIRE(same_x.samples < x.samples);
+    }
+}
+
+TEST_CASE("FFT 3d batch") {
+    SignalInfo info{3, 16};
+    const int64_t sparsity = 16;
+    std::mt19937 gen(11);
+    std::vector<std::vector<complex_t>> spectra(6, std::vector<complex_t>(info.SignalSize()));
+    std::vector<std::vector<complex_t>> data;
+    for (auto& out : spectra) {
+        for (int i = 0; i < sparsity; ++i) {
+            out[gen() % info.SignalSize()] = complex_t(1. + i, 1. - i);
+        }
+        data.push_back(FFTWRunner(info, FFTW_BACKWARD).Run(out));
+    }
+    std::vector<DataSignal> signals;
+    for (const auto& in : data) {
+        signals.emplace_back(info, in.data());
+    }
+    std::vector<const Signal*> batch;
+    for (const auto& x : signals) {
+        batch.push_back(&x);
+    }
+    ThreadPool pool(4);
+    TransformSettings settings;
+    settings.thread_pool = &pool;
+    auto results = BatchSparseFFT(batch, info, sparsity, 2, 7, settings);
+    auto sequential = BatchSparseFFT(batch, info, sparsity, 2, 7);
+    REQUIRE(results.size() == spectra.size());
+    for (size_t i = 0; i < spectra.size(); ++i) {
+        auto result = GetSignalFromMap(results[i], info);
+        REQUIRE(std::equal(spectra[i].begin(), spectra[i].end(), result.begin(), CheckEqual));
+        REQUIRE(results[i].Sorted() == RecursiveSparseFFT(signals[i], info, sparsity, 2, 7, settings).Sorted());
+        REQUIRE(sequential[i].Sorted() == RecursiveSparseFFT(signals[i], info, sparsity, 2, 7).Sorted());
+    }
+}
+
+TEST_CASE("FFT 2d plan") {
+    SignalInfo info{2, 64};
+    const int64_t sparsity = 24;
+    std::mt19937 gen(13);
+    std::vector<std::vector<complex_t>> spectra(4, std::vector<complex_t>(info.SignalSize()));
+    std::vector<std::vector<complex_t>> data;
+    for (auto& out : spectra) {
+        for (int i = 0; i < sparsity; ++i) {
+            out[gen() % info.SignalSize()] = complex_t(2. + i, -1. * i);
+        }
+        data.push_back(FFTWRunner(info, FFTW_BACKWARD).Run(out));
+    }
+    for (bool use_comb : {true, false}) {
+        TransformSettings settings;
+        settings.use_comb = use_comb;
+        for (int rank : {1, 2}) {
+            const SparseFFTPlan plan(info, sparsity, rank, settings);
+            // executions of one plan on several threads
+            std::vector<FrequencyMap> results(data.size());
+            std::vector<std::thread> threads;
+            for (size_t i = 0; i < data.size(); ++i) {
+                threads.emplace_back([&, i] {
+                    results[i] = plan.Execute(DataSignal(info, data[i].data()), 5 + i);
+                });
+            }
+            for (auto& thread : threads) {
+                thread.join();
+            }
+            for (size_t i = 0; i < data.size(); ++i) {
+                DataSignal x(info, data[i].data());
+                REQUIRE(results[i].Sorted() == RecursiveSparseFFT(x, info, sparsity, rank, 5 + i, settings).Sorted());
+                // again with the node arenas left by the previous executions
+                REQUIRE(plan.Execute(x, 5 + i).Sorted() == results[i].Sorted());
+                auto result = GetSignalFromMap(results[i], info);
+                REQUIRE(std::equal(spectra[i].begin(), spectra[i].end(), result.begin(), CheckEqual));
+            }
+        }
+    }
+}
+
+TEST_CASE("FFT 3d float") {
+    SignalInfo info{3, 32};
+    const int64_t sparsity = 32;
+    std::vector<complex_t> out(info.SignalSize());
+    std::mt19937 gen(17);
+    for (int i = 0; i < sparsity; ++i) {
+        out[gen() % info.SignalSize()] = complex_t(1. + i % 7, 2. - i % 5);
+    }
+    auto in = FFTWRunner(info, FFTW_BACKWARD).Run(out);
+    std::vector<std::complex<float>> in_float(in.begin(), in.end());
+    FloatDataSignal x(info, in_float.data());
+    REQUIRE(x.ZeroThreshold() == RealTraits<float>::kEps);
+    // the threshold follows the samples, single_precision only selects the float comb
+    for (bool single_precision : {true, false}) {
+        TransformSettings settings;
+        settings.single_precision = single_precision;
+        for (bool use_comb : {true, false}) {
+            settings.use_comb = use_comb;
+            for (int rank : {1, 2}) {
+                auto result = RecursiveSparseFFT(x, info, sparsity, rank, 61, settings);
+                REQUIRE(result.size() == static_cast<size_t>(std::count_if(out.begin(), out.end(), [](complex_t value) { return NonZero(value); })));
+                for (const auto& freq : result) {
+                    REQUIRE(std::abs(freq.second - out[freq.first]) < 1e-3);
+                }
+            }
+        }
+    }
+}
@@ -67,4 +67,28 @@ TEST_CASE("FFT 4d rank 4 1048576 random") {
         out[j] = (id + 1.) + (3. * id - 1.) * 1.i;
     }
     REQUIRE(RunFFTWTest(out, info, sparsity, 4));
-}
\ No newline at end of file
+}
+
+TEST_CASE("FFT 3d rank 3 thread pool") {
+    SignalInfo info{3, 16};
+    const int64_t sparsity = 32;
+    std::vector<complex_t> out(info.SignalSize());
+    for (int i = 0; i < info.SignalSize(); i += info.SignalSize() / sparsity) {
+        size_t j = random() % info.SignalSize();
+        int id = i % 9;
+        out[j] = (id + 1.) + (3. * id - 1.) * 1.i;
+    }
+    ThreadPool pool(4);
+    TransformSettings settings;
+    settings.use_comb = false;
+    settings.thread_pool = &pool;
+    settings.parallel_zero_test = true;
+    REQUIRE(RunFFTWTest(out, info, sparsity, 3, 61, settings));
+    // nested solves run in parallel, but are verified and merged in a fixed order
+    auto in = FFTWRunner(info, FFTW_BACKWARD).Run(out);
+    DataSignal x(info, in.data());
+    auto first = RecursiveSparseFFT(x, info, sparsity, 3, 7, settings).Sorted();
+    for (int iter = 0; iter < 3; ++iter) {
+        REQUIRE(RecursiveSparseFFT(x, info, sparsity, 3, 7, settings).Sorted() == first);
+    }
+}
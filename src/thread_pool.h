@@ -0,0 +1,227 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Work-stealing pool. Every worker has its own deque: tasks spawned by a worker go to the back
+// of its deque and are taken from the back, idle workers steal from the front of the others.
+// Tasks spawned outside the workers go to a shared queue. A thread waiting for a group of tasks
+// runs queued tasks meanwhile, so tasks may spawn and wait for other tasks.
+class ThreadPool {
+public:
+    class TaskGroup;
+
+    explicit ThreadPool(int threads = static_cast<int>(std::thread::hardware_concurrency())) :
+        threads_(std::max(threads, 1)) {
+        // the last queue is the shared one
+        for (int i = 0; i <= threads_; ++i) {
+            queues_.push_back(std::make_unique<Queue>());
+        }
+        workers_.reserve(threads_);
+        for (int i = 0; i < threads_; ++i) {
+            workers_.emplace_back([this, i] { WorkerLoop(i); });
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+            stop_ = true;
+        }
+        has_tasks_.notify_all();
+        for (auto& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    int Size() const {
+        return threads_;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    struct Worker {
+        const ThreadPool* pool{nullptr};
+        int index{-1};
+    };
+
+    static Worker& CurrentWorker() {
+        static thread_local Worker worker;
+        return worker;
+    }
+
+    // index of the queue of the calling thread
+    int OwnQueue() const {
+        const auto& worker = CurrentWorker();
+        return worker.pool == this ? worker.index : Size();
+    }
+
+    void Push(std::function<void()> task) {
+        auto& queue = *queues_[OwnQueue()];
+        {
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            queue.tasks.push_back(std::move(task));
+        }
+        queued_.fetch_add(1);
+        {
+            // pairs with the check of queued_ by a worker going to sleep
+            std::lock_guard<std::mutex> lock(sleep_mutex_);
+        }
+        has_tasks_.notify_one();
+    }
+
+    bool TryRunOne() {
+        std::function<void()> task;
+        int own = OwnQueue();
+        if (own < Size() && PopBack(*queues_[own], task)) {
+            Run(task);
+            return true;
+        }
+        int count = static_cast<int>(queues_.size());
+        int start = own < Size() ? own + 1 : 0;
+        for (int i = 0; i < count; ++i) {
+            int victim = (start + i) % count;
+            if (victim != own && PopFront(*queues_[victim], task)) {
+                Run(task);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool PopBack(Queue& queue, std::function<void()>& task) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    static bool PopFront(Queue& queue, std::function<void()>& task) {
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.tasks.empty()) {
+            return false;
+        }
+        task = std::move(queue.tasks.front());
+        queue.tasks.pop_front();
+        return true;
+    }
+
+    void Run(std::function<void()>& task) {
+        queued_.fetch_sub(1);
+        task();
+    }
+
+    void WorkerLoop(int index) {
+        CurrentWorker() = {this, index};
+        while (true) {
+            if (TryRunOne()) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleep_mutex_);
+            has_tasks_.wait(lock, [this] { return stop_ || queued_.load() > 0; });
+            if (stop_ && queued_.load() == 0) {
+                return;
+            }
+        }
+    }
+
+    const int threads_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    std::atomic<int64_t> queued_{0};
+    std::mutex sleep_mutex_;
+    std::condition_variable has_tasks_;
+    bool stop_{false};
+};
+
+// Tasks spawned together and waited for together. Without a pool tasks run inline.
+// The first exception thrown by a task is rethrown by Wait.
+class ThreadPool::TaskGroup {
+public:
+    explicit TaskGroup(ThreadPool* pool) : pool_(pool) {
+    }
+
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup() {
+        WaitAll();
+    }
+
+    template <class F>
+    void Run(F&& task) {
+        if (!pool_) {
+            task();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++pending_;
+        }
+        pool_->Push([this, task = std::forward<F>(task)]() mutable {
+            std::exception_ptr error;
+            try {
+                task();
+            } catch (...) {
+                error = std::current_exception();
+            }
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (error && !error_) {
+                error_ = error;
+            }
+            if (--pending_ == 0) {
+                done_.notify_all();
+            }
+        });
+    }
+
+    void Wait() {
+        WaitAll();
+        if (error_) {
+            std::rethrow_exception(std::exchange(error_, nullptr));
+        }
+    }
+
+private:
+    void WaitAll() {
+        while (true) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (pending_ == 0) {
+                    return;
+                }
+            }
+            if (!pool_->TryRunOne()) {
+                // the remaining tasks are running on other threads
+                std::unique_lock<std::mutex> lock(mutex_);
+                done_.wait(lock, [this] { return pending_ == 0; });
+                return;
+            }
+        }
+    }
+
+    ThreadPool* pool_;
+    std::mutex mutex_;
+    std::condition_variable done_;
+    int pending_{0};
+    std::exception_ptr error_;
+};
@@ -7,51 +7,127 @@
 #include "arithmetics.h"
 #include "tuple"
 #include "iostream"
+#include "optional"
+#include "mutex"
+
+class Filter;
+
+// Residuals of the filtered signal at sample times, cached by ZeroTest for the cone of a node
+struct ResidualCache {
+    // root path of the filter the residuals were computed with
+    std::vector<int> path;
+    std::vector<int64_t> times;
+    std::vector<complex_t> residuals;
+    // number of logged known frequencies already subtracted
+    size_t version{0};
+};
 
 class SplittingTree {
 public:
     struct Node;
-    using NodePtr = std::shared_ptr<Node>;
+    class NodePool;
+    class NodePools;
 
-    explicit SplittingTree(const SplittingTree* parent_tree, const NodePtr& parent_node): parent_tree_(parent_tree),
-        parent_node_(parent_node), root_(std::make_shared<Node>()) {
-        if (parent_tree) {
-            root_->label = parent_node_->label;
-            root_->level = parent_node_->level;
+    // Non-owning handle of a node. Nodes live in the arena of their tree and stay valid,
+    // possibly removed, until the tree is destroyed.
+    class NodePtr {
+    public:
+        NodePtr(Node* node = nullptr) : node_(node) {}
+
+        Node* get() const {
+            return node_;
+        }
+
+        Node* operator->() const {
+            return node_;
+        }
+
+        Node& operator*() const {
+            return *node_;
+        }
+
+        explicit operator bool() const {
+            return node_ != nullptr;
+        }
+
+        bool operator==(const NodePtr& other) const {
+            return node_ == other.node_;
         }
-    }
 
-    SplittingTree(): parent_tree_(nullptr), parent_node_(nullptr), root_(std::make_shared<Node>()) {}
+        bool operator!=(const NodePtr& other) const {
+            return node_ != other.node_;
+        }
+
+        bool operator<(const NodePtr& other) const {
+            return std::less<Node*>()(node_, other.node_);
+        }
+
+    private:
+        Node* node_;
+    };
+
+    static constexpr uint32_t kNoNode = UINT32_MAX;
 
     struct Node {
         int level{0};
         int64_t label{0};
 
-        NodePtr left{nullptr};
-        NodePtr right{nullptr};
-        Node* parent{nullptr};
+        // positions of the children and the parent in the arena of the tree
+        uint32_t left{kNoNode};
+        uint32_t right{kNoNode};
+        uint32_t parent{kNoNode};
+        uint32_t index{kNoNode};
+        NodePool* pool{nullptr};
+
+        // statistics of the subtree: number of leaves, weight and position of the lightest leaf,
+        // kept up to date on the way to the root whenever the tree changes
+        int leaves{1};
+        int weight{0};
+        uint32_t lightest{kNoNode};
+
+        // caches of the node as a leaf: its root path, filter and ZeroTest residuals;
+        // a node has a cached path or filter only if its parent has one too
+        std::optional<std::vector<int>> leaf_path;
+        std::shared_ptr<const Filter> filter;
+        ResidualCache residuals;
+
+        NodePtr Left() const {
+            return left == kNoNode ? nullptr : &pool->At(left);
+        }
+
+        NodePtr Right() const {
+            return right == kNoNode ? nullptr : &pool->At(right);
+        }
 
-        Node(int length, int64_t label) : level(length), label(label) {}
-        Node() {}
+        Node* Parent() const {
+            return parent == kNoNode || Removed() ? nullptr : &pool->At(parent);
+        }
 
         NodePtr MakeLeft() {
             assert(level >= 0);
-            auto son = std::make_shared<Node>(level + 1, label + (1ll << static_cast<int64_t>(level)));
-            son->parent = this;
-            this->left = son;
-            return son;
+            Node& son = pool->New(level + 1, label + (1ll << static_cast<int64_t>(level)), index);
+            left = son.index;
+            if (right != kNoNode) {
+                // the node is in the root path of its children now
+                pool->At(right).DropCaches();
+            }
+            UpdateStatsToRoot();
+            return &son;
         }
 
         NodePtr MakeRight() {
             assert(level >= 0);
-            auto son = std::make_shared<Node>(level + 1, label);
-            son->parent = this;
-            this->right = son;
-            return son;
+            Node& son = pool->New(level + 1, label, index);
+            right = son.index;
+            if (left != kNoNode) {
+                pool->At(left).DropCaches();
+            }
+            UpdateStatsToRoot();
+            return &son;
         }
 
         bool HasBothChild() const {
-            return left && right;
+            return left != kNoNode && right != kNoNode;
         }
 
         std::pair<NodePtr, NodePtr> AddChildren() {
@@ -59,22 +135,208 @@ public:
         }
 
         bool Removed() const {
-            return this == parent;
+            return parent == index;
+        }
+
+        // a node with both children weighs one more than its lighter child, ties go to the right
+        bool UpdateStats() {
+            int old_leaves = leaves;
+            int old_weight = weight;
+            uint32_t old_lightest = lightest;
+            if (HasBothChild()) {
+                const Node& l = pool->At(left);
+                const Node& r = pool->At(right);
+                leaves = l.leaves + r.leaves;
+                const Node& lighter = l.weight < r.weight ? l : r;
+                weight = lighter.weight + 1;
+                lightest = lighter.lightest;
+            } else if (left != kNoNode || right != kNoNode) {
+                const Node& son = pool->At(left != kNoNode ? left : right);
+                leaves = son.leaves;
+                weight = son.weight;
+                lightest = son.lightest;
+            } else {
+                leaves = 1;
+                weight = 0;
+                lightest = index;
+            }
+            return leaves != old_leaves || weight != old_weight || lightest != old_lightest;
+        }
+
+        void UpdateStatsToRoot() {
+            for (Node* v = this; v && v->UpdateStats(); v = v->Parent()) {
+            }
+        }
+
+        void DropCaches() {
+            if (!leaf_path && !filter) {
+                return;
+            }
+            leaf_path.reset();
+            filter.reset();
+            residuals = ResidualCache();
+            if (left != kNoNode) {
+                pool->At(left).DropCaches();
+            }
+            if (right != kNoNode) {
+                pool->At(right).DropCaches();
+            }
         }
     };
 
+    // Arena of the nodes of one tree. Chunks grow geometrically and never move, so handles
+    // stay valid; nodes are never freed one by one. Reset empties the arena in O(1) and keeps
+    // the chunks, a node slot is cleaned when it is handed out again.
+    class NodePool {
+    public:
+        NodePool() = default;
+        NodePool(const NodePool&) = delete;
+        NodePool& operator=(const NodePool&) = delete;
+
+        Node& New(int level, int64_t label, uint32_t parent) {
+            if (size_ == capacity_) {
+                size_t chunk_size = kFirstChunk << chunks_.size();
+                chunks_.emplace_back(new Node[chunk_size]);
+                capacity_ += static_cast<uint32_t>(chunk_size);
+            }
+            Node& node = At(size_);
+            if (node.pool) {
+                // slot of a node released by Reset, the residual buffers keep their memory
+                node.left = kNoNode;
+                node.right = kNoNode;
+                node.leaves = 1;
+                node.weight = 0;
+                node.leaf_path.reset();
+                node.filter.reset();
+                node.residuals.path.clear();
+                node.residuals.times.clear();
+                node.residuals.residuals.clear();
+                node.residuals.version = 0;
+            }
+            node.level = level;
+            node.label = label;
+            node.parent = parent;
+            node.index = size_++;
+            node.pool = this;
+            node.lightest = node.index;
+            return node;
+        }
+
+        Node& At(uint32_t index) const {
+            // chunk c holds kFirstChunk * 2^c nodes starting from kFirstChunk * (2^c - 1)
+            uint32_t scaled = index / kFirstChunk + 1;
+            int chunk = 31 - __builtin_clz(scaled);
+            return chunks_[chunk][index - kFirstChunk * ((1u << chunk) - 1)];
+        }
+
+        uint32_t Size() const {
+            return size_;
+        }
+
+        void Reset() {
+            size_ = 0;
+        }
+
+    private:
+        static constexpr uint32_t kFirstChunk = 8;
+
+        std::vector<std::unique_ptr<Node[]>> chunks_;
+        uint32_t size_{0};
+        uint32_t capacity_{0};
+    };
+
+    // Arenas shared by a tree and the trees nested in it, e.g. the nested solves of the Restorer. A tree takes
+    // an arena when it is built and gives it back reset when it is destroyed, so nested trees reuse the nodes
+    // of the finished ones instead of allocating their own. Nested trees may be built concurrently.
+    class NodePools {
+    public:
+        NodePools() = default;
+        NodePools(const NodePools&) = delete;
+        NodePools& operator=(const NodePools&) = delete;
+
+        std::unique_ptr<NodePool> Take() {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (free_.empty()) {
+                return std::make_unique<NodePool>();
+            }
+            auto pool = std::move(free_.back());
+            free_.pop_back();
+            return pool;
+        }
+
+        void Give(std::unique_ptr<NodePool> pool) {
+            pool->Reset();
+            std::lock_guard<std::mutex> lock(mutex_);
+            free_.push_back(std::move(pool));
+        }
+
+    private:
+        std::mutex mutex_;
+        std::vector<std::unique_ptr<NodePool>> free_;
+    };
+
+    // Nested trees share the arenas of their parent tree, a root tree uses pools when given and its own ones otherwise.
+    explicit SplittingTree(const SplittingTree* parent_tree, const NodePtr& parent_node, NodePools* pools = nullptr):
+        parent_tree_(parent_tree), parent_node_(parent_node),
+        own_pools_(parent_tree || pools ? nullptr : std::make_unique<NodePools>()),
+        pools_(parent_tree ? parent_tree->pools_ : pools ? pools : own_pools_.get()),
+        pool_(pools_->Take()), root_(&pool_->New(0, 0, kNoNode)) {
+        if (parent_tree) {
+            root_->label = parent_node_->label;
+            root_->level = parent_node_->level;
+        }
+    }
+
+    SplittingTree(): SplittingTree(nullptr, nullptr) {}
+
+    SplittingTree(const SplittingTree&) = delete;
+    SplittingTree& operator=(const SplittingTree&) = delete;
+
+    ~SplittingTree() {
+        pools_->Give(std::move(pool_));
+    }
+
+    // levels of the nodes with both children on the way from the root, the root goes first
     std::vector<int> GetRootPath(const NodePtr& v) const {
-        std::vector<int> path;
-        ReversedRootPath(v, path);
+        std::vector<int> path = GetLeafPath(v.get());
+        if (v->HasBothChild()) {
+            path.push_back(v->level);
+        }
         return path;
     }
 
+    // root path of the node as if it had no children, cached in the nodes
+    const std::vector<int>& GetLeafPath(Node* v) const {
+        if (!v->leaf_path) {
+            if (Node* parent = v->Parent()) {
+                std::vector<int> path = GetLeafPath(parent);
+                if (parent->HasBothChild()) {
+                    path.push_back(parent->level);
+                }
+                v->leaf_path = std::move(path);
+            } else if (parent_tree_) {
+                v->leaf_path = parent_tree_->GetRootPath(parent_node_);
+            } else {
+                v->leaf_path.emplace();
+            }
+        }
+        return *v->leaf_path;
+    }
+
+    const SplittingTree* GetParentTree() const {
+        return parent_tree_;
+    }
+
+    const NodePtr& GetParentNode() const {
+        return parent_node_;
+    }
+
     NodePtr GetRoot() const {
         return root_;
     }
 
     NodePtr GetLightestNode() const {
-        return getLightest(root_).first;
+        return &pool_->At(root_->lightest);
     }
 
     void RemoveNode(NodePtr node) {
@@ -82,31 +344,39 @@ public:
         Node* son = nullptr;
         while (current && !current->HasBothChild()) {
             son = current;
-            current = current->parent;
+            current = current->Parent();
         }
         if (!current) {
-            node->parent = node.get();
-            DeleteNode(root_);
+            DeleteNode(root_.get());
+            node->parent = node->index;
+            root_ = nullptr;
             return;
         }
-        NodePtr other_son;
-        if (current->left.get() == son) {
-            DeleteNode(current->left);
-            other_son = current->right;
+        Node* other_son;
+        if (current->left == son->index) {
+            DeleteNode(son);
+            current->left = kNoNode;
+            other_son = &pool_->At(current->right);
         } else {
-            DeleteNode(current->right);
-            other_son = current->left;
+            DeleteNode(son);
+            current->right = kNoNode;
+            other_son = &pool_->At(current->left);
         }
+        // current leaves the root paths of the remaining subtree
+        other_son->DropCaches();
         if (current != root_.get()) {
-            auto parent = current->parent;
-            other_son->parent = parent;
-            if (parent->left.get() == current) {
-                parent->left = other_son;
+            auto parent = current->Parent();
+            other_son->parent = parent->index;
+            if (parent->left == current->index) {
+                parent->left = other_son->index;
             } else {
-                parent->right = other_son;
+                parent->right = other_son->index;
             }
+            parent->UpdateStatsToRoot();
+        } else {
+            current->UpdateStatsToRoot();
         }
-        node->parent = node.get();
+        node->parent = node->index;
     }
 
     bool IsEmpty() const {
@@ -114,78 +384,63 @@ public:
     }
 
     int LeavesCount() const {
-        return root_ ? SubtreeLeavesCount(root_) : 0;
+        return root_ ? root_->leaves : 0;
     }
 
     int SubtreeLeavesCount(const NodePtr& node) const {
-        if (!node->left && !node->right) {
-            return 1;
-        }
-        int res = 0;
-        if (node->left) {
-            res += SubtreeLeavesCount(node->left);
-        }
-        if (node->right) {
-            res += SubtreeLeavesCount(node->right);
-        }
-        return res;
+        return node->leaves;
     }
 
 private:
-    void ReversedRootPath(const NodePtr& v, std::vector<int>& path) const {
-        for (auto node = v.get(); node != nullptr; node = node->parent) {
-            if (node->HasBothChild()) {
-                path.push_back(node->level);
+    // marks the branch removed and releases its caches, the nodes stay in the arena
+    void DeleteNode(Node* node) const {
+        std::vector<Node*> stack = {node};
+        while (!stack.empty()) {
+            Node* current = stack.back();
+            stack.pop_back();
+            if (current->left != kNoNode) {
+                stack.push_back(&pool_->At(current->left));
             }
-        }
-        if (parent_tree_) {
-            parent_tree_->ReversedRootPath(parent_node_, path);
-        }
-    }
-
-    void DeleteNode(NodePtr& node) const {
-        node->parent = node.get();
-        node.reset();
-    }
-
-    std::pair<NodePtr, int> getLightest(const NodePtr& node) const {
-        if (!node->left && !node->right) {
-            return {node, 0};
-        }
-        NodePtr lightest(nullptr);
-        int weight;
-        if (node->left) {
-            std::tie(lightest, weight) = getLightest(node->left);
-        }
-        if (node->right) {
-            if (lightest) {
-                auto [right_lightest, right_weight] = getLightest(node->right);
-                lightest = weight < right_weight ? lightest : right_lightest;
-                return {lightest, std::min(weight, right_weight) + 1};
-            } else {
-                std::tie(lightest, weight) = getLightest(node->right);
+            if (current->right != kNoNode) {
+                stack.push_back(&pool_->At(current->right));
             }
+            current->leaf_path.reset();
+            current->filter.reset();
+            current->residuals = ResidualCache();
         }
-        return {lightest, weight + node->HasBothChild()};
+        node->parent = node->index;
     }
+
     const SplittingTree* parent_tree_;
     NodePtr parent_node_;
+    std::unique_ptr<NodePools> own_pools_;
+    NodePools* pools_;
+    std::unique_ptr<NodePool> pool_;
     NodePtr root_;
 };
 
+namespace std {
+    template<>
+    struct hash<SplittingTree::NodePtr> {
+        std::size_t operator()(const SplittingTree::NodePtr& node) const {
+            return std::hash<SplittingTree::Node*>()(node.get());
+        }
+    };
+}
+
 void PrintNodeAsDot(const SplittingTree::NodePtr& node) {
     if (!node) {
         return;
     }
     std::cout << "n" << node.get() << "[label=\"level: " << node->level << "\nlabel: " << node->label << "\"];\n";
-    if (node->left) {
-        std::cout << "n" << node.get() << " -> n" << node->left.get() <<";\n";
+    if (node->Left()) {
+        std::cout << "n" << node.get() << " -> n" << node->Left().get() <<";\n";
     }
-    if (node->right) {
-        std::cout << "n" << node.get() << " -> n" << node->right.get() <<";\n";
+    if (node->Right()) {
+        std::cout << "n" << node.get() << " -> n" << node->Right().get() <<";\n";
     }
-    PrintNodeAsDot(node->left);
-    PrintNodeAsDot(node->right);
+    PrintNodeAsDot(node->Left());
+    PrintNodeAsDot(node->Right());
 }
 
 void PrintTreeAsDot(const SplittingTree& tree, const std::string& name) {